@@ -0,0 +1,1977 @@
+/* Microbenchmarks for fanController, run with `make bench`.
+ *
+ * fanController.c is compiled in whole with its NVML function table pointed
+ * at the stubs below, so every case runs the real control code without a
+ * driver or a GPU. Results are printed to stdout as one JSON object.
+ *
+ *   ./fanBench [nvml latency in us]
+ *
+ * The latency is spent busy waiting in every stubbed NVML call, to compare
+ * against what a real driver costs on the target machine.
+ *
+ * The simulated cases run the device loop against a thermal model on a
+ * virtual clock, so minutes of control take milliseconds. */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static unsigned long long virtualMs = 0; // 0 uses the real clock
+
+static int benchClockGettime(clockid_t clock, struct timespec *ts) {
+  if (!virtualMs)
+    return clock_gettime(clock, ts);
+  ts->tv_sec = virtualMs / 1000;
+  ts->tv_nsec = virtualMs % 1000 * 1000000;
+  return 0;
+}
+
+static const char *benchNvmlLibrary = NULL; // stub loaded by loadNvml()
+
+#define clock_gettime benchClockGettime
+#define main fanControllerMain
+#define NVML_LIBRARY benchNvmlLibrary
+#define STATUS_PATH "/tmp/fanBench.prom"
+#include "fanController.c"
+#undef main
+#undef clock_gettime
+
+#define BENCH_MIN_NS 200000000ULL // Grow each case until it runs this long
+#define BENCH_STARTS 5            // Start and shutdown samples
+#define BENCH_IDLE_MS 3000        // Idle run used to count wakeups
+#define BENCH_IDLE_STAGGER_MS 30  // Apart the idle devices are adopted
+#define BENCH_CSTATE_RESIDENCY_US 600 // Deep C-state target residency, C6-like
+#define BENCH_DEVICES 2           // Devices started by the threaded cases
+#define BENCH_FANS 2              // Fans reported per stubbed device
+#define BENCH_THROTTLE_TEMP 72    // Stub reports thermal slowdown from here
+#define BENCH_CHASSIS_MINUTES 30  // Length of the chassis fan trace
+#define BENCH_BMC_ROUND_TRIP "0.02" // Seconds the fake BMC takes per command
+#define BENCH_HISTORY_DAYS 30     // History generated for every registry slot
+#define BENCH_HISTORY_START 1767225600000ULL // 2026-01-01, UTC
+#define BENCH_FLIGHT_MINUTES 30   // Length of the flight recorder trace
+#define BENCH_MODEL_TOLERANCE 0.1 // Error allowed in each fitted parameter
+#define BENCH_MODEL_AMBIENT_C 2.0 // and in the fitted air temperature
+#define BENCH_MODEL_C 65          // Temperature planned from after a restart
+#define BENCH_MODEL_W 250         // at this power draw
+#define BENCH_NVML_LOADS 100      // dlopen to Init samples per stub library
+#define BENCH_HOTPLUG_MS 2000     // Run before, between and after hot-plugs
+#define BENCH_HOTPLUG_SLACK_MS 50 // Tick gap allowed over the polling interval
+#define BENCH_RETRY_HOURS 6       // Rescans of a GPU that keeps failing
+#define BENCH_FANLESS 9           // Handle whose fan count cannot be read
+#define BENCH_PLACED_WAKEUPS 500  // Device loop wakeups per placement run
+#define BENCH_PLACED_SLEEP_US 2000 // between them
+#define BENCH_RESTART_TEMP 68     // GPU temperature across a restart
+#define BENCH_FIRMWARE_FAN 35     // Fan % the firmware runs at on its own
+#define BENCH_FAULT_MINUTES 10    // Length of the faulty fan traces
+#define BENCH_FAULT_AT_S 120      // Fan 0 turns faulty this far in
+#define BENCH_FAULT_LAG_MS 4000   // A lagging fan follows 1% per this
+#define BENCH_STEADY_TICKS 1000000 // Ticks checked for allocations and faults
+
+/* Simulated GPU: a constant load cooled towards ambient, better the faster
+ * the fans spin, with the SM clock dropping one bin at each step. Below the
+ * load's demand clocks follow the cube root of the power limit, as voltage
+ * scales with clock. The firmware halves clocks and power from
+ * SIM_SLOWDOWN_TEMP until SIM_SLOWDOWN_CLEAR. */
+#define SIM_MINUTES 30
+#define SIM_STEP_MS 100
+#define SIM_CAPACITY 250.0    // J/C
+#define SIM_COOLING_IDLE 4.44 // W/C with the fans stopped
+#define SIM_COOLING_FAN 5.55  // W/C added at 100% fan
+#define SIM_BOOST_MHZ 1980
+#define SIM_BIN_MHZ 15
+#define SIM_SLOWDOWN_TEMP 87
+#define SIM_SLOWDOWN_CLEAR 82
+#define SIM_POWER_MIN_MW 150000
+#define SIM_POWER_MAX_MW 500000
+#define SIM_HINT_AHEAD_S 20 // Scheduler hints jobs this long before they start
+#define SIM_COUPLING 0.3    // Intake share of the upstream GPU's rise
+static const unsigned int SimBoostSteps[] = {52, 58, 64, 70};
+
+/* With jobSec set the load runs as a trace of jobs, each a new compute
+ * process, with idleSec at the idle power between them. */
+typedef struct {
+  const char *name;
+  double ambient; // C
+  double load;    // W the load would draw without a limit
+  double idle;    // W between jobs
+  unsigned int idleSec;
+  unsigned int jobSec;
+  int perfMode;
+  int powerCap;
+  int precool;
+  int hinted; // the scheduler hints each job SIM_HINT_AHEAD_S early
+  int inlet;  // an inlet sensor reads the ambient temperature
+  int model;  // fits the thermal model and checks it against the simulation
+  int mpc;    // plans the fans on the model fitted by the last model run
+  int unramped; // fans jump to every new target with no hold, as before
+  unsigned int throttleStep; // fan % added per throttled tick
+} SimScenario;
+
+static const SimScenario SimScenarios[] = {
+    {"sim_curve", 25, 250, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_perf_mode", 25, 250, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_hot_curve", 40, 480, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_hot_power_cap", 40, 480, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_jobs_curve", 30, 350, 60, 120, 60, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_jobs_unramped", 30, 350, 60, 120, 60, 0, 0, 0, 0, 0, 0, 0, 1, 0},
+    {"sim_jobs_precool", 30, 350, 60, 120, 60, 0, 0, 1, 0, 0, 0, 0, 0, 0},
+    {"sim_jobs_hinted", 30, 350, 60, 120, 60, 0, 0, 0, 1, 0, 0, 0, 0, 0},
+    {"sim_cold_aisle_curve", 18, 350, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_cold_aisle_inlet", 18, 350, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0},
+    {"sim_warm_aisle_curve", 32, 350, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_warm_aisle_inlet", 32, 350, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0},
+    {"sim_warmer_curve", 34, 350, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"sim_warmer_throttle_boost", 34, 350, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 20},
+    {"sim_jobs_model", 30, 350, 60, 120, 60, 0, 0, 0, 1, 0, 1, 0, 0, 0},
+    {"sim_mpc", 25, 250, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0},
+    {"sim_jobs_mpc", 30, 350, 60, 120, 60, 0, 0, 0, 0, 0, 0, 1, 0, 0},
+};
+
+static unsigned long long latencyNs = 0;
+static volatile unsigned int benchTemp = 60;
+static _Atomic unsigned long long firstControlNs = 0;
+static volatile unsigned int sink;
+static unsigned int simFan[BENCH_FANS];
+static unsigned int simPowerLimit; // mW
+static int simSlowdown;
+static unsigned int simPid; // running compute process, 0 for none
+static unsigned int simPids = 1; // processes from simPid on while it runs
+static unsigned int simPower; // mW drawn at the last step
+static volatile int simFanStalled; // fans read back 0%, else as set
+/* Fan 0 reads back simFanRead while faulty: held where it was, following
+ * the commanded speed 1% per BENCH_FAULT_LAG_MS, or at 0. */
+enum { FAULT_NONE, FAULT_STUCK, FAULT_LAGGING, FAULT_STALLED };
+static volatile int simFanFault;
+static unsigned int simFanRead;
+static unsigned long long simFanReadAt; // ms
+static unsigned long long simWrites;    // fan speeds set
+static unsigned long long simVariation; // fan % moved by them, summed
+static unsigned int simMaxStep;         // largest single move
+static char hwmonDir[] = "/tmp/fanBench.XXXXXX"; // fake /sys/class/hwmon
+/* GPUs the stub enumerates, by handle. Device n has handle n + 1. */
+static unsigned int stubGpus[MAX_DEVICES];
+static unsigned int stubGpuCount = 0;
+static unsigned int stubFanless; // handle failing DeviceGetNumFans, 0 none
+/* Per handle, last temperature read and longest time between two */
+static volatile int trackTicks;
+/* Largest fan step away from fanRef written while trackFans is set */
+static volatile int trackFans;
+static unsigned int fanRef[BENCH_FANS];
+static _Atomic unsigned int fanStep;
+static _Atomic unsigned long long tickAt[MAX_DEVICES + 1];
+static _Atomic unsigned long long tickGap[MAX_DEVICES + 1];
+
+/* Heap allocations by a thread with countAllocs set. Replaces the libc
+ * entry points for the whole process, other threads pass straight through. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static _Thread_local int countAllocs;
+static unsigned long long allocs;
+
+void *malloc(size_t size) {
+  allocs += countAllocs;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocs += countAllocs;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs += countAllocs;
+  return __libc_realloc(ptr, size);
+}
+
+static unsigned long long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void nvmlLatency(void) {
+  if (!latencyNs)
+    return;
+  const unsigned long long until = nowNs() + latencyNs;
+  while (nowNs() < until)
+    continue;
+}
+
+/* Stubbed NVML */
+static const char *stubErrorString(nvmlReturn_t result) {
+  (void)result;
+  return "stub";
+}
+
+static nvmlReturn_t stubGetPciInfo(nvmlDevice_t device, nvmlPciInfo_t *pci) {
+  memset(pci, 0, sizeof(*pci));
+  snprintf(pci->busId, sizeof(pci->busId), "00000000:%02lx:00.0",
+           (unsigned long)(uintptr_t)device);
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetNumFans(nvmlDevice_t device, unsigned int *count) {
+  nvmlLatency();
+  if (stubFanless && (uintptr_t)device == stubFanless)
+    return NVML_ERROR_NOT_SUPPORTED;
+  *count = BENCH_FANS;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetMinMaxFanSpeed(nvmlDevice_t device,
+                                          unsigned int *min,
+                                          unsigned int *max) {
+  (void)device;
+  nvmlLatency();
+  *min = 30;
+  *max = 100;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetTemperature(nvmlDevice_t device,
+                                       nvmlTemperatureSensors_t sensor,
+                                       unsigned int *temp) {
+  (void)sensor;
+  nvmlLatency();
+  *temp = benchTemp;
+  const uintptr_t h = (uintptr_t)device;
+  if (trackTicks && h <= MAX_DEVICES) {
+    const unsigned long long now = nowNs();
+    const unsigned long long last = atomic_exchange(&tickAt[h], now);
+    if (last && now - last > atomic_load(&tickGap[h]))
+      atomic_store(&tickGap[h], now - last);
+  }
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetCount(unsigned int *count) {
+  *count = stubGpuCount;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetHandleByIndex(unsigned int index,
+                                         nvmlDevice_t *device) {
+  if (index >= stubGpuCount)
+    return NVML_ERROR_INVALID_ARGUMENT;
+  *device = (nvmlDevice_t)(uintptr_t)stubGpus[index];
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetUUID(nvmlDevice_t device, char *uuid,
+                                unsigned int length) {
+  snprintf(uuid, length, "GPU-bench-%lu", (unsigned long)(uintptr_t)device - 1);
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetFanSpeed(nvmlDevice_t device, unsigned int fan,
+                                    unsigned int *speed) {
+  (void)device;
+  nvmlLatency();
+  *speed = simFanStalled ? 0 : fan < BENCH_FANS ? simFan[fan] : 60;
+  if (fan == 0 && simFanFault == FAULT_LAGGING) {
+    const unsigned int moved = (virtualMs - simFanReadAt) / BENCH_FAULT_LAG_MS;
+    if (moved) {
+      simFanReadAt += moved * BENCH_FAULT_LAG_MS;
+      if (simFanRead + moved < simFan[0])
+        simFanRead += moved;
+      else if (simFanRead > simFan[0] + moved)
+        simFanRead -= moved;
+      else
+        simFanRead = simFan[0];
+    }
+  }
+  if (fan == 0 && simFanFault)
+    *speed = simFanRead;
+  return NVML_SUCCESS;
+}
+
+static void trackFanStep(const unsigned int fan, const unsigned int speed) {
+  const unsigned int step =
+      speed > fanRef[fan] ? speed - fanRef[fan] : fanRef[fan] - speed;
+  if (step > atomic_load(&fanStep))
+    atomic_store(&fanStep, step);
+}
+
+static nvmlReturn_t stubSetFanSpeed(nvmlDevice_t device, unsigned int fan,
+                                    unsigned int speed) {
+  (void)device;
+  nvmlLatency();
+  if (fan < BENCH_FANS) {
+    const unsigned int step =
+        speed > simFan[fan] ? speed - simFan[fan] : simFan[fan] - speed;
+    simWrites++;
+    simVariation += step;
+    // The first write of a run starts the fans rather than moving them
+    if (simFan[fan] && step > simMaxStep)
+      simMaxStep = step;
+    simFan[fan] = speed;
+  }
+  if (trackFans && fan < BENCH_FANS)
+    trackFanStep(fan, speed);
+  unsigned long long expected = 0;
+  atomic_compare_exchange_strong(&firstControlNs, &expected, nowNs());
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubSetDefaultFanSpeed(nvmlDevice_t device,
+                                           unsigned int fan) {
+  (void)device;
+  nvmlLatency();
+  if (trackFans && fan < BENCH_FANS) {
+    simFan[fan] = BENCH_FIRMWARE_FAN;
+    trackFanStep(fan, BENCH_FIRMWARE_FAN);
+  }
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetClocksEventReasons(nvmlDevice_t device,
+                                              unsigned long long *reasons) {
+  (void)device;
+  nvmlLatency();
+  *reasons = nvmlClocksEventReasonNone;
+  if (simSlowdown)
+    *reasons = nvmlClocksEventReasonHwThermalSlowdown;
+  else if (benchTemp >= BENCH_THROTTLE_TEMP)
+    *reasons = nvmlClocksEventReasonSwThermalSlowdown;
+  return NVML_SUCCESS;
+}
+
+static unsigned int simBinClock(void) {
+  unsigned int clock = SIM_BOOST_MHZ;
+  for (unsigned int i = 0; i < COUNT_OF(SimBoostSteps); i++) {
+    if (benchTemp >= SimBoostSteps[i])
+      clock -= SIM_BIN_MHZ;
+  }
+  return clock;
+}
+
+static nvmlReturn_t stubGetClockInfo(nvmlDevice_t device, nvmlClockType_t type,
+                                     unsigned int *clock) {
+  (void)device;
+  (void)type;
+  nvmlLatency();
+  *clock = simBinClock();
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetPowerLimit(nvmlDevice_t device,
+                                      unsigned int *limit) {
+  (void)device;
+  nvmlLatency();
+  *limit = simPowerLimit;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetPowerLimitConstraints(nvmlDevice_t device,
+                                                 unsigned int *min,
+                                                 unsigned int *max) {
+  (void)device;
+  nvmlLatency();
+  *min = SIM_POWER_MIN_MW;
+  *max = SIM_POWER_MAX_MW;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubSetPowerLimit(nvmlDevice_t device,
+                                      unsigned int limit) {
+  (void)device;
+  nvmlLatency();
+  simPowerLimit = limit;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetPowerUsage(nvmlDevice_t device,
+                                      unsigned int *power) {
+  (void)device;
+  nvmlLatency();
+  *power = simPower;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetComputeProcesses(nvmlDevice_t device,
+                                            unsigned int *count,
+                                            nvmlProcessInfo_t *infos) {
+  (void)device;
+  nvmlLatency();
+  if (!simPid) {
+    *count = 0;
+    return NVML_SUCCESS;
+  }
+  if (*count < simPids) {
+    *count = simPids;
+    return NVML_ERROR_INSUFFICIENT_SIZE;
+  }
+  memset(infos, 0, simPids * sizeof(*infos));
+  for (unsigned int i = 0; i < simPids; i++)
+    infos[i].pid = simPid + i;
+  *count = simPids;
+  return NVML_SUCCESS;
+}
+
+static void stubNvml(void) {
+  nvml.ErrorString = stubErrorString;
+  nvml.DeviceGetCount = stubGetCount;
+  nvml.DeviceGetHandleByIndex = stubGetHandleByIndex;
+  nvml.DeviceGetUUID = stubGetUUID;
+  nvml.DeviceGetPciInfo = stubGetPciInfo;
+  nvml.DeviceGetNumFans = stubGetNumFans;
+  nvml.DeviceGetMinMaxFanSpeed = stubGetMinMaxFanSpeed;
+  nvml.DeviceGetTemperature = stubGetTemperature;
+  nvml.DeviceGetFanSpeed = stubGetFanSpeed;
+  nvml.DeviceSetFanSpeed = stubSetFanSpeed;
+  nvml.DeviceSetDefaultFanSpeed = stubSetDefaultFanSpeed;
+  nvml.DeviceGetCurrentClocksEventReasons = stubGetClocksEventReasons;
+  nvml.DeviceGetClockInfo = stubGetClockInfo;
+  nvml.DeviceGetPowerManagementLimit = stubGetPowerLimit;
+  nvml.DeviceGetPowerManagementLimitConstraints = stubGetPowerLimitConstraints;
+  nvml.DeviceSetPowerManagementLimit = stubSetPowerLimit;
+  nvml.DeviceGetComputeRunningProcesses = stubGetComputeProcesses;
+  nvml.DeviceGetPowerUsage = stubGetPowerUsage;
+}
+
+/* Runs fn with a doubling iteration count until one run takes at least
+ * BENCH_MIN_NS, and prints that run. */
+static void measure(const char *name, void (*fn)(unsigned long long)) {
+  unsigned long long n = 1, elapsed;
+  for (;; n *= 2) {
+    const unsigned long long start = nowNs();
+    fn(n);
+    elapsed = nowNs() - start;
+    if (elapsed >= BENCH_MIN_NS)
+      break;
+  }
+  printf("    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f},\n",
+         name, n, (double)elapsed / n);
+}
+
+static Device benchDevice;
+
+static void setupBenchDevice(void) {
+  memset(&benchDevice, 0, sizeof(benchDevice));
+  benchDevice.handle = (nvmlDevice_t)(uintptr_t)1;
+  benchDevice.rampUpRate = RAMP_UP_RATE;
+  benchDevice.rampDownRate = RAMP_DOWN_RATE;
+  benchDevice.minHoldMs = MIN_HOLD_MS;
+  benchDevice.minFanSpeed = 30;
+  benchDevice.maxFanSpeed = 100;
+  benchDevice.fanCount = BENCH_FANS;
+  for (unsigned int i = 0; i < BENCH_FANS; i++) {
+    Fan *fan = &benchDevice.fans[i];
+    precalcFanTable(fanCurveTable(i), &fan->table, 30, 100);
+    fan->prevFanSpeed = 1;
+    fan->targetFanSpeed = 1;
+  }
+}
+
+// Temperature lookup through the heating and cooling tables
+static void benchLookup(unsigned long long n) {
+  const Fan *fan = &benchDevice.fans[0];
+  for (unsigned long long i = 0; i < n; i++)
+    sink = getFanSpeed(fan, tempIndex(MIN_TEMP - 10 + i % 40));
+}
+
+// Clamping a curve into a fan's table, done once per fan at device start
+static void benchPrecompute(unsigned long long n) {
+  FanTable table;
+  for (unsigned long long i = 0; i < n; i++) {
+    precalcFanTable(fanCurveTable(i % 2), &table, 30 + i % 5, 100);
+    sink = table.up[i % TEMP_STEPS];
+  }
+}
+
+/* Builds the table of a zero RPM curve on a card whose minimum is 0, with
+ * no fall threshold: 0 up to 10 °C above MIN_TEMP, then 20 % and rising.
+ * Checks that the fan starts there and stops ZERO_RPM_STOP_DELTA below. */
+static void zeroRpmTrace(void) {
+  FanTable curve, table;
+  const unsigned int start = 10;
+  for (unsigned int i = 0; i < TEMP_STEPS; i++)
+    curve.up[i] = curve.down[i] = i < start ? 0 : 20 + (i - start) * 2;
+  precalcFanTable(&curve, &table, 0, 100);
+  unsigned int starts = 0, stops = 0;
+  while (starts < TEMP_STEPS && table.up[starts] == 0)
+    starts++;
+  for (unsigned int i = 0; i < TEMP_STEPS; i++) {
+    if (table.down[i] == 0)
+      stops = i;
+  }
+  const int verified = starts == start && stops + ZERO_RPM_STOP_DELTA == start;
+  printf("    {\"name\": \"zero_rpm_band\", \"start_c\": %u, \"stop_c\": %u, "
+         "\"verified\": %s},\n",
+         MIN_TEMP + starts, MIN_TEMP + stops, verified ? "true" : "false");
+}
+
+/* Temperature of the hysteresis trace at second s: a staircase up one degree
+ * every 10 s across the curve, two minutes dithering by 2 °C, then the
+ * staircase back down. */
+static unsigned int hysteresisTemp(const unsigned int s) {
+  const unsigned int low = MIN_TEMP - 5, high = MAX_TEMP + 2;
+  const unsigned int stair = (high - low) * 10;
+  if (s < stair)
+    return low + s / 10;
+  if (s < stair + 120)
+    return MIN_TEMP + 9 + (s % 2) * 2;
+  return high - (s - stair - 120) / 10;
+}
+
+/* Runs the hysteresis trace through the TEMP_THRESHOLD gate that used to
+ * sit in front of the curve, following the curve itself whenever the
+ * temperature moved 2 °C from the last change, and through the up/down
+ * tables. Reports the fan writes of each and how far each fell behind the
+ * curve: the seconds spent below it, the most it was below it, and how many
+ * seconds ago the curve last asked for no more than the fans ran. */
+static void hysteresisTrace(void) {
+  static const unsigned char raw[TEMP_STEPS] = FAN_CURVE_RAW;
+  const unsigned int threshold = 2;
+  enum { SECONDS = (MAX_TEMP + 2 - (MIN_TEMP - 5)) * 20 + 120 };
+  unsigned char curve[SECONDS];
+  Fan fan = benchDevice.fans[0];
+  fan.targetFanSpeed = 0;
+  unsigned int gateTemp = 0, gateSpeed = 0;
+  unsigned int gateWrites = 0, tableWrites = 0;
+  unsigned int gateBehind = 0, tableBehind = 0; // s
+  unsigned int gateLag = 0, tableLag = 0;       // s
+  unsigned int gateShort = 0, tableShort = 0;   // %
+  for (unsigned int s = 0; s < SECONDS; s++) {
+    const unsigned int temp = hysteresisTemp(s);
+    const unsigned int want = raw[tempIndex(temp)];
+    curve[s] = want;
+    const unsigned int diff =
+        temp > gateTemp ? temp - gateTemp : gateTemp - temp;
+    if (diff >= threshold && want != gateSpeed) {
+      gateTemp = temp;
+      gateSpeed = want;
+      gateWrites++;
+    }
+    const unsigned int speed = getFanSpeed(&fan, tempIndex(temp));
+    if (speed != fan.targetFanSpeed) {
+      fan.targetFanSpeed = speed;
+      tableWrites++;
+    }
+    const unsigned int speeds[2] = {gateSpeed, fan.targetFanSpeed};
+    unsigned int *behind[2] = {&gateBehind, &tableBehind};
+    unsigned int *lags[2] = {&gateLag, &tableLag};
+    unsigned int *shorts[2] = {&gateShort, &tableShort};
+    for (unsigned int k = 0; k < 2; k++) {
+      if (speeds[k] >= want)
+        continue;
+      (*behind[k])++;
+      unsigned int back = 1;
+      while (back <= s && curve[s - back] > speeds[k])
+        back++;
+      if (back > *lags[k])
+        *lags[k] = back;
+      if (want - speeds[k] > *shorts[k])
+        *shorts[k] = want - speeds[k];
+    }
+  }
+  printf("    {\"name\": \"hysteresis_trace\", \"seconds\": %u, "
+         "\"threshold_writes\": %u, \"threshold_behind_s\": %u, "
+         "\"threshold_max_lag_s\": %u, \"threshold_max_short_percent\": %u, "
+         "\"table_writes\": %u, \"table_behind_s\": %u, "
+         "\"table_max_lag_s\": %u, \"table_max_short_percent\": %u},\n",
+         SECONDS, gateWrites, gateBehind, gateLag, gateShort, tableWrites,
+         tableBehind, tableLag, tableShort);
+}
+/* One pass of the device loop without its sleep. The temperature sweeps
+ * the curve one degree every 8 ticks so ramps, holds and thermal slowdown
+ * above BENCH_THROTTLE_TEMP are exercised. */
+static void benchTick(unsigned long long n) {
+  for (unsigned long long i = 0; i < n; i++) {
+    const unsigned int step = i / 8 % 60;
+    benchTemp = MIN_TEMP - 10 + (step < 30 ? step : 60 - step);
+    sink = deviceTick(&benchDevice);
+  }
+}
+
+static long minorFaults(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_minflt;
+}
+
+/* Runs the tick sweep on the virtual clock with the flight recorder and
+ * the thermal model on, then counts heap allocations and minor page faults
+ * over another BENCH_STEADY_TICKS. The steady state must have neither. */
+static void steadyTrace(void) {
+  setupBenchDevice();
+  benchDevice.flightMode = 1;
+  benchDevice.modelMode = 1;
+  initModel(&benchDevice.model);
+  long faults = 0;
+  virtualMs = monotonicMs();
+  for (unsigned long long i = 0; i < 2 * BENCH_STEADY_TICKS; i++) {
+    if (i == BENCH_STEADY_TICKS) {
+      allocs = 0;
+      countAllocs = 1;
+      faults = minorFaults();
+    }
+    const unsigned int step = i / 8 % 60;
+    benchTemp = MIN_TEMP - 10 + (step < 30 ? step : 60 - step);
+    virtualMs += deviceTick(&benchDevice);
+  }
+  faults = minorFaults() - faults;
+  countAllocs = 0;
+  virtualMs = 0;
+  benchTemp = 60;
+  printf("    {\"name\": \"tick_steady_state\", \"ticks\": %d, "
+         "\"allocations\": %llu, \"minor_faults\": %ld, "
+         "\"verified\": %s},\n",
+         BENCH_STEADY_TICKS, allocs, faults,
+         allocs == 0 && faults == 0 ? "true" : "false");
+  setupBenchDevice();
+}
+
+/* Steps the number of compute processes across MAX_PROCESSES through
+ * watchProcesses(). A new process must boost the fans once whether NVML
+ * lists it or only reports that there are too many to list, and the
+ * processes already running when it comes back below must not. */
+static void precoolOverflow(void) {
+  static const struct {
+    unsigned int pids;
+    unsigned int events; // expected boosts so far
+  } Steps[] = {
+      {10, 0},
+      {MAX_PROCESSES + 8, 1},
+      {MAX_PROCESSES + 8, 1},
+      {MAX_PROCESSES + 9, 2},
+      {20, 2},
+      {21, 3},
+  };
+  setupBenchDevice();
+  benchDevice.precoolMode = 1;
+  simPid = 1000;
+  int verified = 1;
+  for (unsigned int i = 0; i < COUNT_OF(Steps); i++) {
+    simPids = Steps[i].pids;
+    watchProcesses(&benchDevice, i * PROCESS_WATCH_MS);
+    verified &= benchDevice.precoolEvents == Steps[i].events &&
+                benchDevice.processCount == Steps[i].pids;
+  }
+  simPid = 0;
+  simPids = 1;
+  printf("    {\"name\": \"precool_overflow\", \"max_processes\": %d, "
+         "\"steps\": %zu, \"precool_events\": %u, \"verified\": %s},\n",
+         MAX_PROCESSES, COUNT_OF(Steps), benchDevice.precoolEvents,
+         verified ? "true" : "false");
+  setupBenchDevice();
+}
+
+// Fans on the fake Super I/O chip, one per source
+static const ChassisFan BenchChassisFans[] = {
+    {"nct6798", 1, CHASSIS_MAX_TEMP, 45, 80, 80, 255},
+    {"nct6798", 2, CHASSIS_SUM_POWER, 200, 1400, 60, 255},
+    {NULL, 0, 0, 0, 0, 0, 0},
+};
+
+/* Lays out an inlet sensor, a CPU sensor that is not one and two PWM
+ * outputs in automatic mode, the way hwmon drivers do, and takes them over
+ * through findAmbientSensors() and findChassisFans(). */
+static void makeHwmon(void) {
+  static const char *files[][2] = {
+      {"hwmon0/name", "nct6798\n"},
+      {"hwmon0/temp1_label", "Inlet\n"},
+      {"hwmon0/temp1_input", "25000\n"},
+      {"hwmon0/pwm1", "120\n"},
+      {"hwmon0/pwm1_enable", "5\n"},
+      {"hwmon0/pwm2", "90\n"},
+      {"hwmon0/pwm2_enable", "5\n"},
+      {"hwmon1/name", "coretemp\n"},
+      {"hwmon1/temp1_label", "Package id 0\n"},
+      {"hwmon1/temp1_input", "55000\n"},
+  };
+  char path[64];
+  if (!mkdtemp(hwmonDir))
+    return;
+  for (unsigned int i = 0; i < COUNT_OF(files); i++) {
+    snprintf(path, sizeof(path), "%s/hwmon%c", hwmonDir, files[i][0][5]);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%s", hwmonDir, files[i][0]);
+    FILE *f = fopen(path, "w");
+    if (f) {
+      fputs(files[i][1], f);
+      fclose(f);
+    }
+  }
+  findAmbientSensors(hwmonDir);
+  findChassisFans(hwmonDir, BenchChassisFans);
+}
+
+static void removeHwmon(void) {
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", hwmonDir);
+  if (system(cmd) != 0)
+    fprintf(stderr, "Failed to remove %s\n", hwmonDir);
+}
+
+// Sets the fake inlet sensor and has the main thread's read pick it up
+static void setInlet(const double celsius) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/hwmon0/temp1_input", hwmonDir);
+  FILE *f = fopen(path, "w");
+  if (f) {
+    fprintf(f, "%d\n", (int)(celsius * 1000));
+    fclose(f);
+  }
+  readAmbient();
+}
+
+// One read of the inlet sensors, done every AMBIENT_INTERVAL_MS
+static void benchAmbientRead(unsigned long long n) {
+  for (unsigned long long i = 0; i < n; i++)
+    readAmbient();
+}
+
+static ThermalModel simFitted; // by the last run with model set
+
+/* Prints the thermal model fitted during a run next to the simulation's
+ * own constants, and checks each against BENCH_MODEL_TOLERANCE or, for the
+ * air temperature, BENCH_MODEL_AMBIENT_C. */
+static void printModelFit(const SimScenario *sim) {
+  ModelParams p, u;
+  modelParams(&benchDevice.model, &p, &u);
+  const ModelParams truth = {SIM_CAPACITY, SIM_COOLING_IDLE, SIM_COOLING_FAN,
+                             sim->ambient};
+  const double errors[] = {
+      fabs(p.capacity / truth.capacity - 1),
+      fabs(p.conductance / truth.conductance - 1),
+      fabs(p.fanGain / truth.fanGain - 1),
+  };
+  int verified = fabs(p.ambient - truth.ambient) < BENCH_MODEL_AMBIENT_C;
+  for (unsigned int i = 0; i < COUNT_OF(errors); i++)
+    verified &= errors[i] < BENCH_MODEL_TOLERANCE;
+  printf(", \"model_updates\": %llu, "
+         "\"capacity_j_per_c\": [%.1f, %.1f, %.3f], "
+         "\"conductance_w_per_c\": [%.2f, %.2f, %.3f], "
+         "\"fan_gain_w_per_c\": [%.2f, %.2f, %.3f], "
+         "\"ambient_c\": [%.1f, %.1f, %.3f], "
+         "\"model_error_c_per_s\": %.3f, \"verified\": %s",
+         benchDevice.model.updates, truth.capacity, p.capacity, u.capacity,
+         truth.conductance, p.conductance, u.conductance, truth.fanGain,
+         p.fanGain, u.fanGain, truth.ambient, p.ambient, u.ambient,
+         sqrt(benchDevice.model.noise), verified ? "true" : "false");
+}
+
+/* The planner on a model trusted as if fitted, at temperatures and power
+ * that move every tick and a new fit every MODEL_INTERVAL_MS of ticks */
+static void benchMpcPlan(unsigned long long n) {
+  setupBenchDevice();
+  initModel(&benchDevice.model);
+  for (unsigned int i = 0; i < MODEL_PARAMS; i++)
+    benchDevice.model.cov[i][i] = 1e-4;
+  benchDevice.model.updates = MPC_MIN_UPDATES;
+  for (unsigned long long i = 0; i < n; i++) {
+    if (i % (MODEL_INTERVAL_MS / 1000) == 0)
+      benchDevice.model.updates++;
+    sink = planFanSpeed(&benchDevice, (i + 1) * 1000, 50 + i % 25,
+                        150000 + i % 7 * 30000);
+  }
+  sink += benchDevice.mpcLevels;
+  setupBenchDevice();
+}
+
+// One step of the thermal model's recursive least squares fit
+static void benchModelUpdate(unsigned long long n) {
+  ThermalModel model;
+  initModel(&model);
+  for (unsigned long long i = 0; i < n; i++) {
+    const double x[MODEL_PARAMS] = {3.0 + i % 3, -0.6, -0.2, 1};
+    updateModel(&model, x, 0.01 * (i % 5));
+  }
+  sink = model.updates;
+}
+
+/* Saves the model fitted by the last simulation, loads it back as a
+ * restart would and checks that a device adopted on the same bus resumes
+ * from it: same coefficients, and the same first plan and prediction. */
+static void modelRestart(void) {
+  static Device resumed;
+  char path[64];
+  snprintf(path, sizeof(path), "%s/thermal-models", hwmonDir);
+  setupBenchDevice();
+  snprintf(benchDevice.uuid, sizeof(benchDevice.uuid), "GPU-bench-model");
+  snprintf(benchDevice.busId, sizeof(benchDevice.busId), "00000000:01:00.0");
+  benchDevice.modelMode = 1;
+  benchDevice.model = simFitted;
+  storeModel(&benchDevice);
+  writeModels(path);
+  modelCount = 0;
+  loadModels(path);
+  const ModelRecord *r = findModel(benchDevice.uuid, benchDevice.busId);
+  resumed = benchDevice;
+  if (r)
+    resumed.model = r->model;
+
+  double power[MPC_STEPS];
+  for (unsigned int k = 0; k < MPC_STEPS; k++)
+    power[k] = BENCH_MODEL_W;
+  const int saved = planFanSpeed(&benchDevice, 1, BENCH_MODEL_C,
+                                 BENCH_MODEL_W * 1000);
+  const int plan = planFanSpeed(&resumed, 1, BENCH_MODEL_C,
+                                BENCH_MODEL_W * 1000);
+  double savedTemp = BENCH_MODEL_C, temp = BENCH_MODEL_C;
+  if (saved >= 0 && plan >= 0) {
+    predictTemp(&benchDevice, 0, power, 0, MPC_STEPS, &savedTemp);
+    predictTemp(&resumed, 0, power, 0, MPC_STEPS, &temp);
+  }
+  const int restored =
+      modelCount == 1 && r && benchDevice.model.updates > 0 &&
+      r->model.updates == benchDevice.model.updates &&
+      memcmp(r->model.theta, benchDevice.model.theta,
+             sizeof(r->model.theta)) == 0 &&
+      memcmp(r->model.cov, benchDevice.model.cov, sizeof(r->model.cov)) == 0 &&
+      saved >= 0 && plan == saved && temp == savedTemp;
+  printf("    {\"name\": \"model_restart\", \"models\": %u, "
+         "\"updates\": %llu, \"plan_percent\": %d, \"saved_plan_percent\": %d, "
+         "\"prediction_c\": %.3f, \"saved_prediction_c\": %.3f, "
+         "\"restored\": %s},\n",
+         modelCount, r ? r->model.updates : 0, plan, saved, temp, savedTemp,
+         restored ? "true" : "false");
+  modelCount = 0;
+}
+
+/* Runs the device loop for SIM_MINUTES of virtual time against the
+ * simulated GPU, starting cool, and prints the SM clock and fan duty over
+ * the run. */
+static void simulate(const SimScenario *sim) {
+  setupBenchDevice();
+  benchDevice.perfMode = sim->perfMode;
+  benchDevice.precoolMode = sim->precool;
+  benchDevice.modelMode = sim->model || sim->mpc;
+  benchDevice.mpcMode = sim->mpc;
+  benchDevice.mpcPlan = -1;
+  benchDevice.throttleStep = sim->throttleStep;
+  if (sim->mpc && simFitted.updates)
+    benchDevice.model = simFitted;
+  else
+    initModel(&benchDevice.model);
+  simPowerLimit = sim->load * 1000;
+  simSlowdown = 0;
+  if (sim->powerCap)
+    initPowerCap(&benchDevice);
+  atomic_store(&ambientShift, 0);
+  if (sim->inlet)
+    setInlet(sim->ambient);
+  if (sim->unramped) {
+    benchDevice.rampUpRate = benchDevice.rampDownRate = 100000;
+    benchDevice.minHoldMs = 0;
+  }
+  for (unsigned int i = 0; i < BENCH_FANS; i++)
+    simFan[i] = 0;
+  simWrites = simVariation = simMaxStep = 0;
+
+  double temp = 45.0, clockSum = 0, clockSquares = 0, fanSum = 0;
+  double powerSum = 0, fanPowerSum = 0, peak = temp;
+  unsigned long long steps = 0, ticks = 0, planned = 0, slowdownMs = 0;
+  const unsigned long long start = monotonicMs();
+  virtualMs = start;
+  while (virtualMs - start < SIM_MINUTES * 60000ULL) {
+    benchTemp = (unsigned int)(temp + 0.5);
+    const unsigned int delay = deviceTick(&benchDevice);
+    ticks++;
+    planned += benchDevice.mpcPlan >= 0;
+    for (unsigned int ms = 0; ms < delay; ms += SIM_STEP_MS) {
+      double fan = 0;
+      for (unsigned int i = 0; i < BENCH_FANS; i++)
+        fan += simFan[i] / (double)BENCH_FANS;
+      if (temp >= SIM_SLOWDOWN_TEMP)
+        simSlowdown = 1;
+      else if (temp < SIM_SLOWDOWN_CLEAR)
+        simSlowdown = 0;
+      double load = sim->load;
+      if (sim->jobSec) {
+        const unsigned long long sec = (virtualMs - start) / 1000;
+        const unsigned int cycle = sim->idleSec + sim->jobSec;
+        const int busy = sec % cycle >= sim->idleSec;
+        simPid = busy ? 1000 + sec / cycle : 0;
+        load = busy ? sim->load : sim->idle;
+        const unsigned int hintAt = sim->idleSec - SIM_HINT_AHEAD_S;
+        if (sim->hinted && sec % cycle == hintAt &&
+            atomic_load(&benchDevice.hintEnd) < virtualMs)
+          setHint(&benchDevice, sim->load, SIM_HINT_AHEAD_S * 1000,
+                  sim->jobSec * 1000, virtualMs);
+      }
+      const double limit = simPowerLimit / 1000.0;
+      double power = limit < load ? limit : load;
+      double clock = simBinClock() * cbrt(power / load);
+      if (simSlowdown) {
+        power /= 2;
+        clock /= 2;
+      }
+      simPower = power * 1000;
+      const double cooling = SIM_COOLING_IDLE + SIM_COOLING_FAN * fan / 100;
+      temp += (power - cooling * (temp - sim->ambient)) / SIM_CAPACITY *
+              SIM_STEP_MS / 1000;
+      benchTemp = (unsigned int)(temp + 0.5);
+      if (temp > peak)
+        peak = temp;
+      if (simSlowdown || benchTemp >= BENCH_THROTTLE_TEMP)
+        slowdownMs += SIM_STEP_MS;
+      clockSum += clock;
+      clockSquares += clock * clock;
+      fanSum += fan;
+      fanPowerSum += fan * fan * fan / 1e4;
+      powerSum += power;
+      steps++;
+      virtualMs += SIM_STEP_MS;
+    }
+  }
+  if (benchDevice.throttledSince)
+    benchDevice.throttledMs += virtualMs - benchDevice.throttledSince;
+  virtualMs = 0;
+  simPid = 0;
+  const int shift = atomic_exchange(&ambientShift, 0);
+
+  const double clockAvg = clockSum / steps;
+  const double clockVar = clockSquares / steps - clockAvg * clockAvg;
+  printf("    {\"name\": \"%s\", \"minutes\": %d, "
+         "\"avg_sm_clock_mhz\": %.1f, \"sm_clock_stddev_mhz\": %.1f, "
+         "\"avg_fan_percent\": %.1f, \"fan_power_percent\": %.1f, "
+         "\"fan_writes\": %llu, \"fan_variation_percent\": %llu, "
+         "\"max_fan_step_percent\": %u, "
+         "\"avg_power_w\": %.1f, "
+         "\"peak_temp_c\": %.1f, \"final_temp_c\": %.1f, "
+         "\"slowdown_s\": %.1f, \"throttle_events\": %u, "
+         "\"throttled_s\": %.1f, "
+         "\"boost_steps_learned\": %d, \"curve_shift_c\": %d",
+         sim->name, SIM_MINUTES, clockAvg, clockVar > 0 ? sqrt(clockVar) : 0,
+         fanSum / steps, fanPowerSum / steps, simWrites, simVariation,
+         simMaxStep,
+         powerSum / steps, peak, temp, slowdownMs / 1e3,
+         benchDevice.throttleEvents, benchDevice.throttledMs / 1e3,
+         __builtin_popcountll(benchDevice.perfSteps), shift);
+  if (sim->model) {
+    printModelFit(sim);
+    simFitted = benchDevice.model;
+  }
+  if (sim->mpc)
+    printf(", \"mpc_ceiling_c\": %d, \"planned_percent\": %.1f",
+           MPC_CEILING_C, 100.0 * planned / ticks);
+  printf("},\n");
+}
+
+/* Two GPUs in one airflow, the second taking in the first's exhaust: its
+ * intake is SIM_COUPLING of the way from ambient to the first GPU's
+ * temperature. The first runs the job trace, the second a steady load. Both
+ * device loops take turns on the virtual clock, the second with the first
+ * as its neighbour when coupled, and the peak temperature and fan speed of
+ * each are printed. */
+static void simulateCoupled(const char *name, const int coupled) {
+  const double ambient = 30, load = 350, idle = 60, steady = 150;
+  const unsigned int idleSec = 60, jobSec = 120;
+  double temp[2] = {45, 45}, peak[2] = {45, 45}, fanSum[2] = {0, 0};
+  unsigned int fans[2][BENCH_FANS] = {{0}}, peakFan[2] = {0, 0};
+  int slowdown[2] = {0, 0};
+  unsigned long long due[2], steps = 0;
+  setupBenchDevice();
+  for (unsigned int d = 0; d < 2; d++) {
+    memcpy(&registry[d], &benchDevice, sizeof(benchDevice));
+    registry[d].handle = (nvmlDevice_t)(uintptr_t)(d + 1);
+    atomic_store(&registry[d].snapshot, 0);
+  }
+  registry[1].neighbours[0] = 0;
+  registry[1].neighbourCount = coupled;
+
+  const unsigned long long start = monotonicMs();
+  virtualMs = due[0] = due[1] = start;
+  while (virtualMs - start < SIM_MINUTES * 60000ULL) {
+    for (unsigned int d = 0; d < 2; d++) {
+      if (virtualMs < due[d])
+        continue;
+      benchTemp = (unsigned int)(temp[d] + 0.5);
+      simSlowdown = slowdown[d];
+      memcpy(simFan, fans[d], sizeof(simFan));
+      due[d] = virtualMs + deviceTick(&registry[d]);
+      memcpy(fans[d], simFan, sizeof(simFan));
+    }
+    const unsigned long long sec = (virtualMs - start) / 1000;
+    const double power[2] = {
+        sec % (idleSec + jobSec) >= idleSec ? load : idle, steady};
+    const double intake[2] = {ambient,
+                              ambient + SIM_COUPLING * (temp[0] - ambient)};
+    for (unsigned int d = 0; d < 2; d++) {
+      double fan = 0;
+      for (unsigned int i = 0; i < BENCH_FANS; i++) {
+        fan += fans[d][i] / (double)BENCH_FANS;
+        if (fans[d][i] > peakFan[d])
+          peakFan[d] = fans[d][i];
+      }
+      if (temp[d] >= SIM_SLOWDOWN_TEMP)
+        slowdown[d] = 1;
+      else if (temp[d] < SIM_SLOWDOWN_CLEAR)
+        slowdown[d] = 0;
+      const double cooling = SIM_COOLING_IDLE + SIM_COOLING_FAN * fan / 100;
+      temp[d] += (power[d] / (slowdown[d] ? 2 : 1) -
+                  cooling * (temp[d] - intake[d])) /
+                 SIM_CAPACITY * SIM_STEP_MS / 1000;
+      if (temp[d] > peak[d])
+        peak[d] = temp[d];
+      fanSum[d] += fan;
+    }
+    steps++;
+    virtualMs += SIM_STEP_MS;
+  }
+  virtualMs = 0;
+  simSlowdown = 0;
+  benchTemp = 60;
+  memset(registry, 0, 2 * sizeof(registry[0]));
+
+  printf("    {\"name\": \"%s\", \"minutes\": %d, \"coupled\": %s, "
+         "\"upstream_peak_temp_c\": %.1f, \"downstream_peak_temp_c\": %.1f, "
+         "\"upstream_avg_fan_percent\": %.1f, "
+         "\"downstream_avg_fan_percent\": %.1f, "
+         "\"upstream_peak_fan_percent\": %u, "
+         "\"downstream_peak_fan_percent\": %u},\n",
+         name, SIM_MINUTES, coupled ? "true" : "false", peak[0], peak[1],
+         fanSum[0] / steps, fanSum[1] / steps, peakFan[0], peakFan[1]);
+  setupBenchDevice();
+}
+
+/* Registry slot 0 poses as an active device, for cases of the main thread
+ * that look at the devices */
+static void poseDevice(const int active) {
+  Device *device = &registry[0];
+  if (active) {
+    memset(device, 0, sizeof(*device));
+    snprintf(device->uuid, sizeof(device->uuid), "GPU-bench-0");
+    snprintf(device->busId, sizeof(device->busId), "00000000:01:00.0");
+  }
+  atomic_store(&device->state, active ? SLOT_ACTIVE : SLOT_FREE);
+}
+
+// Parsing and applying one hint line
+static void benchHintParse(unsigned long long n) {
+  poseDevice(1);
+  for (unsigned long long i = 0; i < n; i++) {
+    char buf[] = "GPU-bench-0 350 20000 600000";
+    handleHints(buf, i);
+  }
+  poseDevice(0);
+}
+
+// A hint datagram from send() until the main thread has applied it
+static void benchHintIngest(unsigned long long n) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, fds) != 0)
+    return;
+  poseDevice(1);
+  const char hint[] = "00000000:01:00.0 350 20000 600000";
+  for (unsigned long long i = 0; i < n; i++) {
+    send(fds[1], hint, sizeof(hint) - 1, 0);
+    readHints(fds[0]);
+  }
+  poseDevice(0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* Publishes a temperature and power for the posed device, as its thread
+ * would */
+static void poseReading(const unsigned int temp, const unsigned int watts) {
+  atomic_store(&registry[0].snapshot, temp << 16);
+  atomic_store(&registry[0].power, watts * 1000);
+}
+
+// One pass over the chassis fans, with the GPU moving a degree now and then
+static void benchChassisUpdate(unsigned long long n) {
+  poseDevice(1);
+  for (unsigned long long i = 0; i < n; i++) {
+    poseReading(60 + i / 8 % 10, 250 + i / 8 % 10 * 20);
+    updateChassisFans();
+  }
+  poseDevice(0);
+}
+
+/* A GPU cycling through jobs every 6 minutes, with a couple of degrees and
+ * watts of sensor noise, at update i of intervalMs each. */
+static void poseTrace(const unsigned int i, const unsigned int intervalMs) {
+  const double sec = (double)i * intervalMs / 1000;
+  const double load = sin(sec / 180 * M_PI) > 0 ? 1 : 0.2;
+  poseReading(45 + 25 * load + i * 7 % 3, 60 + 290 * load + i * 13 % 7);
+}
+
+/* Drives the chassis fans from BENCH_CHASSIS_MINUTES of the job trace and
+ * counts the sysfs writes against one per update without coalescing. The
+ * outputs are then handed back and checked against the fake tree. */
+static void chassisTrace(void) {
+  const unsigned int updates = BENCH_CHASSIS_MINUTES * 60000 /
+                               CHASSIS_INTERVAL_MS;
+  unsigned long long writes = 0;
+  poseDevice(1);
+  for (unsigned int i = 0; i < chassisCount; i++) {
+    chassis[i].pwm = -1;
+    chassis[i].writes = 0;
+  }
+  for (unsigned int i = 0; i < updates; i++) {
+    poseTrace(i, CHASSIS_INTERVAL_MS);
+    updateChassisFans();
+  }
+  poseDevice(0);
+  for (unsigned int i = 0; i < chassisCount; i++)
+    writes += chassis[i].writes;
+  restoreChassisFans();
+
+  int restored = chassisCount == 2;
+  for (unsigned int i = 0; i < chassisCount; i++) {
+    int enable, pwm;
+    restored &= readNumber(chassis[i].enableFd, &enable) && enable == 5 &&
+                readNumber(chassis[i].pwmFd, &pwm) &&
+                pwm == chassis[i].pwmOrig;
+  }
+  printf("    {\"name\": \"chassis_trace\", \"minutes\": %d, \"fans\": %u, "
+         "\"updates\": %u, \"writes\": %llu, \"uncoalesced_writes\": %u, "
+         "\"restored\": %s},\n",
+         BENCH_CHASSIS_MINUTES, chassisCount, updates, writes,
+         updates * chassisCount, restored ? "true" : "false");
+}
+
+static const BmcZone BenchBmcZones[] = {
+    {"system", 0, CHASSIS_MAX_TEMP, 45, 80, 30, 100},
+    {"peripheral", 1, CHASSIS_SUM_POWER, 100, 400, 30, 100},
+    {NULL, 0, 0, 0, 0, 0, 0},
+};
+
+/* Runs the job trace through the BMC backend with a stand-in for ipmitool
+ * that takes BENCH_BMC_ROUND_TRIP for each command and logs it. Reports
+ * the batches and commands sent against one command per zone and update,
+ * the main thread's time per batch, and checks the log. */
+static void bmcTrace(void) {
+  char log[64], script[192];
+  snprintf(log, sizeof(log), "%s/bmc.log", hwmonDir);
+  snprintf(script, sizeof(script),
+           "while read -r line; do sleep %s; echo \"$line\" >> %s; done",
+           BENCH_BMC_ROUND_TRIP, log);
+  char *const argv[] = {"/bin/sh", "-c", script, NULL};
+  initBmc(argv, BenchBmcZones);
+
+  const unsigned int updates = BENCH_CHASSIS_MINUTES * 60000 / BMC_INTERVAL_MS;
+  unsigned long long busyNs = 0;
+  poseDevice(1);
+  for (unsigned int i = 0; i < updates; i++) {
+    poseTrace(i, BMC_INTERVAL_MS);
+    const unsigned long long start = nowNs();
+    updateBmc();
+    busyNs += nowNs() - start;
+  }
+  poseDevice(0);
+  stopBmc();
+
+  unsigned int lines = 0;
+  char line[128], first[128] = "", last[128] = "";
+  FILE *f = fopen(log, "r");
+  while (f && fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(lines++ ? last : first, sizeof(line), "%s", line);
+  }
+  if (f)
+    fclose(f);
+  const int verified = lines == bmc.commands + 2 &&
+                       strcmp(first, BMC_MANUAL) == 0 &&
+                       strcmp(last, BMC_RESTORE) == 0;
+  printf("    {\"name\": \"bmc_trace\", \"minutes\": %d, \"zones\": %u, "
+         "\"updates\": %u, \"batches\": %llu, \"commands\": %llu, "
+         "\"unbatched_commands\": %u, \"ns_per_batch\": %.1f, "
+         "\"errors\": %llu, \"verified\": %s},\n",
+         BENCH_CHASSIS_MINUTES, bmc.zoneCount, updates, bmc.batches,
+         bmc.commands, updates * bmc.zoneCount,
+         bmc.batches ? (double)busyNs / bmc.batches : 0, bmc.errors,
+         verified ? "true" : "false");
+  bmc.zoneCount = 0;
+}
+
+// Appending a sample to a device's history ring, done once a second
+static void benchHistoryRecord(unsigned long long n) {
+  Device *device = &benchDevice;
+  for (unsigned long long i = 0; i < n; i++) {
+    recordHistory(device, i * 1000, 60 + i % 3, 45);
+    if (i % HISTORY_RING == HISTORY_RING - 1)
+      atomic_store(&device->historyTail, atomic_load(&device->historyHead));
+  }
+}
+
+/* Records BENCH_HISTORY_DAYS of the job trace for all MAX_DEVICES slots at
+ * HISTORY_INTERVAL_MS, flushing as the main thread would, and reports the
+ * bytes per sample. Then times fanHistory summarising all of it and checks
+ * an hour of one GPU read back as CSV. */
+static void historyTrace(void) {
+  char dir[64], cmd[192];
+  snprintf(dir, sizeof(dir), "%s/history", hwmonDir);
+  mkdir(dir, 0755);
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    memset(&registry[d], 0, sizeof(registry[d]));
+    snprintf(registry[d].uuid, sizeof(registry[d].uuid), "GPU-bench-%02u", d);
+    atomic_store(&registry[d].state, SLOT_ACTIVE);
+  }
+
+  const unsigned long long samples =
+      BENCH_HISTORY_DAYS * HISTORY_DAY_MS / HISTORY_INTERVAL_MS;
+  const unsigned long long start = nowNs();
+  for (unsigned long long i = 0; i < samples; i++) {
+    virtualMs = BENCH_HISTORY_START + i * HISTORY_INTERVAL_MS;
+    for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+      const double sec = (double)(i + d * 37) * HISTORY_INTERVAL_MS / 1000;
+      const double load = sin(sec / 180 * M_PI) > 0 ? 1 : 0.2;
+      recordHistory(&registry[d], virtualMs,
+                    45 + 25 * load + (i * 7 + d) % 3, 30 + 50 * load);
+    }
+    if ((i + 1) * HISTORY_INTERVAL_MS % HISTORY_FLUSH_MS == 0)
+      flushHistory(dir);
+  }
+  flushHistory(dir);
+  const double recordMs = (nowNs() - start) / 1e6;
+  virtualMs = 0;
+  close(historyFd);
+  historyFd = -1;
+  historyDay = -1;
+  for (unsigned int d = 0; d < MAX_DEVICES; d++)
+    atomic_store(&registry[d].state, SLOT_FREE);
+
+  snprintf(cmd, sizeof(cmd), "./fanHistory -d %s > /dev/null", dir);
+  const unsigned long long scanStart = nowNs();
+  const int scanned = system(cmd) == 0;
+  const double scanMs = (nowNs() - scanStart) / 1e6;
+
+  snprintf(cmd, sizeof(cmd),
+           "./fanHistory -d %s -g GPU-bench-03 -f 2026-01-10T12:00 "
+           "-t 2026-01-10T12:59:59 -c",
+           dir);
+  unsigned int rows = 0;
+  char line[128], first[128] = "";
+  FILE *f = popen(cmd, "r");
+  while (f && fgets(line, sizeof(line), f)) {
+    if (rows++ == 1)
+      snprintf(first, sizeof(first), "%s", line);
+  }
+  if (f)
+    pclose(f);
+  // 2026-01-10T12:00 is sample 777600, at full load for GPU 3
+  const int verified =
+      scanned && rows == 3601 &&
+      strcmp(first, "2026-01-10T12:00:00Z,GPU-bench-03,70,80\n") == 0;
+  printf("    {\"name\": \"history_month\", \"days\": %d, \"gpus\": %d, "
+         "\"samples\": %llu, \"bytes\": %llu, \"bytes_per_sample\": %.2f, "
+         "\"record_ms\": %.1f, \"scan_ms\": %.1f, \"verified\": %s},\n",
+         BENCH_HISTORY_DAYS, MAX_DEVICES, historySamples, historyBytes,
+         (double)historyBytes / historySamples, recordMs, scanMs,
+         verified ? "true" : "false");
+}
+
+// One tick kept by the flight recorder, with its trigger checks
+static void benchFlightRecord(unsigned long long n) {
+  setupBenchDevice();
+  benchDevice.flightMode = 1;
+  for (unsigned long long i = 0; i < n; i++)
+    recordFlight(&benchDevice, i * 1000, 60 + i % 3, 60 + i % 3, 45, 0, 0);
+  setupBenchDevice();
+}
+
+/* Temperature of the flight recorder trace at a second: steady, then a
+ * job that heats the GPU 20 C in 30 s and into thermal slowdown, and
+ * after it the fans stall. */
+static unsigned int flightTemp(const unsigned long long sec) {
+  if (sec < 300 || sec >= 900)
+    return 60;
+  if (sec < 330)
+    return 60 + (sec - 300) * 20 / 30;
+  return 80;
+}
+
+/* Runs BENCH_FLIGHT_MINUTES of the trace through the device loop with the
+ * flight recorder on, dumping captures as the main thread would, then reads
+ * the dumps back. Checks that the fast rise and the stalled fans each left
+ * one dump covering FLIGHT_PRE_MS before and FLIGHT_POST_MS after the
+ * trigger, sampled every FLIGHT_FAST_MS after it, and that the slowdown
+ * during the first capture did not start another. */
+static void flightTrace(void) {
+  char dir[64];
+  snprintf(dir, sizeof(dir), "%s/flight", hwmonDir);
+  mkdir(dir, 0755);
+  setupBenchDevice();
+  benchDevice.flightMode = 1;
+  snprintf(benchDevice.uuid, sizeof(benchDevice.uuid), "GPU-bench-flight");
+  unsigned long long ticks = 0;
+  const unsigned long long start = monotonicMs();
+  virtualMs = start;
+  while (virtualMs - start < BENCH_FLIGHT_MINUTES * 60000ULL) {
+    const unsigned long long sec = (virtualMs - start) / 1000;
+    benchTemp = flightTemp(sec);
+    simFanStalled = sec >= 1200;
+    virtualMs += deviceTick(&benchDevice);
+    dumpFlight(dir, &benchDevice);
+    ticks++;
+  }
+  virtualMs = 0;
+  simFanStalled = 0;
+  benchTemp = 60;
+
+  struct dirent **names;
+  const int count = scandir(dir, &names, NULL, alphasort);
+  unsigned int dumps = 0, rows = 0, verified = 1;
+  char reasons[64] = "";
+  long long gap = 0;
+  for (int n = 0; n < count; n++) {
+    char path[PATH_MAX], line[128], reason[16];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[n]->d_name);
+    FILE *f = names[n]->d_name[0] != '.' ? fopen(path, "r") : NULL;
+    free(names[n]);
+    if (!f)
+      continue;
+    long long first = 0, last = 0, prev = 0;
+    unsigned int samples = 0;
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "# %*s %15s", reason) != 1)
+      verified = 0;
+    while (fgets(line, sizeof(line), f)) {
+      long long ms;
+      if (sscanf(line, "%lld,", &ms) != 1)
+        continue;
+      if (!samples++)
+        first = ms;
+      if (ms > 0 && ms - prev > gap)
+        gap = ms - prev;
+      prev = last = ms;
+    }
+    fclose(f);
+    snprintf(reasons + strlen(reasons), sizeof(reasons) - strlen(reasons),
+             "%s%s", dumps++ ? "," : "", reason);
+    rows += samples;
+    verified &= first <= -FLIGHT_PRE_MS + 1000 && first >= -FLIGHT_PRE_MS &&
+                last >= FLIGHT_POST_MS - FLIGHT_FAST_MS;
+  }
+  free(names);
+  verified &= dumps == 2 && strcmp(reasons, "slope,fan") == 0 &&
+              gap == FLIGHT_FAST_MS;
+  printf("    {\"name\": \"flight_trace\", \"minutes\": %d, "
+         "\"ticks\": %llu, \"dumps\": %u, \"reasons\": \"%s\", "
+         "\"rows\": %u, \"capture_interval_ms\": %lld, "
+         "\"ring_kb\": %zu, \"verified\": %s},\n",
+         BENCH_FLIGHT_MINUTES, ticks, dumps, reasons, rows, gap,
+         sizeof(benchDevice.flight) / 1024, verified ? "true" : "false");
+  setupBenchDevice();
+}
+
+// A fan counter of the bench device in STATUS_PATH, 0 if it is not there
+static unsigned int statusCounter(const char *metric) {
+  char prefix[96], line[160];
+  unsigned int value = 0;
+  const int n =
+      snprintf(prefix, sizeof(prefix), "fancontroller_fan_%s{gpu=\"%s\","
+               "fan=\"0\"} ", metric, benchDevice.uuid);
+  FILE *f = fopen(STATUS_PATH, "r");
+  while (f && fgets(line, sizeof(line), f)) {
+    if (strncmp(line, prefix, n) == 0)
+      value = strtoul(line + n, NULL, 10);
+  }
+  if (f)
+    fclose(f);
+  return value;
+}
+
+/* Runs BENCH_FAULT_MINUTES of a GPU stepping between 58 and 70 °C every
+ * minute, with fan 0 turning faulty at BENCH_FAULT_AT_S. The status is
+ * written as the main thread would just before the fault and at the end.
+ * Checks that its lag, degraded and stall counters went from 0 to more,
+ * and with FAN_FALLBACK_MODE that fan 1 was run at full speed while fan 0
+ * was stalled, and not for any other fault. */
+static void faultTrace(const char *name, const int fault) {
+  setupBenchDevice();
+  snprintf(benchDevice.uuid, sizeof(benchDevice.uuid), "GPU-bench-fault");
+  benchDevice.fallbackMode = 1;
+  Device *status = &registry[0];
+  unsigned int before = 0, fullSpeed = 1;
+  unsigned long long fallbackMs = 0, healthyMs = 0;
+  const unsigned long long start = monotonicMs();
+  virtualMs = start;
+  while (virtualMs - start < BENCH_FAULT_MINUTES * 60000ULL) {
+    const unsigned long long sec = (virtualMs - start) / 1000;
+    benchTemp = sec / 60 % 2 ? 70 : 58;
+    if (sec >= BENCH_FAULT_AT_S && !simFanFault) {
+      memcpy(status, &benchDevice, sizeof(benchDevice));
+      atomic_store(&status->state, SLOT_ACTIVE);
+      writeStatus();
+      before = statusCounter("lag_total") + statusCounter("degraded_total") +
+               statusCounter("stall_total");
+      simFanRead = fault == FAULT_STALLED ? 0 : simFan[0];
+      simFanReadAt = virtualMs;
+      simFanFault = fault;
+    }
+    const unsigned int stalled = benchDevice.stalledFans;
+    const unsigned long long ms = deviceTick(&benchDevice);
+    if (stalled) {
+      fallbackMs += ms;
+      fullSpeed &= benchDevice.fans[1].targetFanSpeed == 100;
+    } else if (!simFanFault) {
+      healthyMs += ms;
+    }
+    virtualMs += ms;
+  }
+  memcpy(status, &benchDevice, sizeof(benchDevice));
+  atomic_store(&status->state, SLOT_ACTIVE);
+  writeStatus();
+  const unsigned int lag = statusCounter("lag_total");
+  const unsigned int degraded = statusCounter("degraded_total");
+  const unsigned int stalled = statusCounter("stall_total");
+  unlink(STATUS_PATH);
+  atomic_store(&status->state, SLOT_FREE);
+  virtualMs = 0;
+  simFanFault = FAULT_NONE;
+  benchTemp = 60;
+
+  const int fellBack = fault == FAULT_STALLED ? fallbackMs > 0 && fullSpeed
+                                             : fallbackMs == 0;
+  const int verified = before == 0 && lag + degraded + stalled > 0 &&
+                       fellBack &&
+                       healthyMs >= BENCH_FAULT_AT_S * 1000ULL - 1000;
+  printf("    {\"name\": \"%s\", \"minutes\": %d, \"lag_total\": %u, "
+         "\"degraded_total\": %u, \"stall_total\": %u, "
+         "\"fallback_s\": %.1f, \"verified\": %s},\n",
+         name, BENCH_FAULT_MINUTES, lag, degraded, stalled, fallbackMs / 1e3,
+         verified ? "true" : "false");
+  setupBenchDevice();
+}
+
+/* Starts BENCH_DEVICES device threads and times adoption until the first
+ * fan speed is written. */
+static unsigned long long startDevices(void) {
+  atomic_store(&firstControlNs, 0);
+  terminate = 0;
+  const unsigned long long start = nowNs();
+  for (unsigned int i = 0; i < BENCH_DEVICES; i++) {
+    char uuid[32];
+    snprintf(uuid, sizeof(uuid), "GPU-bench-%u", i);
+    adoptDevice((nvmlDevice_t)(uintptr_t)(i + 1), i, uuid);
+  }
+  while (!atomic_load(&firstControlNs))
+    sched_yield();
+  return atomic_load(&firstControlNs) - start;
+}
+
+// Times terminate until every device thread has reset its fans and exited
+static unsigned long long stopDevices(void) {
+  const unsigned long long start = nowNs();
+  terminate = 1;
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) != SLOT_FREE) {
+      pthread_join(registry[i].thread, NULL);
+      atomic_store(&registry[i].state, SLOT_FREE);
+    }
+  }
+  return nowNs() - start;
+}
+
+static void printSamples(const char *name, const unsigned long long *ns,
+                         const unsigned int count) {
+  unsigned long long total = 0, max = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    total += ns[i];
+    if (ns[i] > max)
+      max = ns[i];
+  }
+  printf("    {\"name\": \"%s\", \"iterations\": %u, \"ns_per_op\": %.1f, "
+         "\"max_ns\": %llu},\n",
+         name, count, (double)total / count, max);
+}
+
+/* Sets the GPUs the stub enumerates and runs a rescan as on SIGHUP.
+ * Returns how long the main thread spent in it. */
+static unsigned long long plugGpus(const unsigned int *handles,
+                                   const unsigned int count) {
+  memcpy(stubGpus, handles, count * sizeof(*handles));
+  stubGpuCount = count;
+  const unsigned long long start = nowNs();
+  rescanDevices();
+  return nowNs() - start;
+}
+
+/* Lists a GPU whose fan count cannot be read and rescans every
+ * RESCAN_INTERVAL_MS of virtual time for BENCH_RETRY_HOURS, waiting for
+ * the thread of every adoption to give up. Reports how often the GPU was
+ * adopted against the rescans, each of which adopted it before the
+ * backoff, and the wait it ended on. */
+static void retryTrace(void) {
+  static const unsigned int Fanless[] = {BENCH_FANLESS};
+  unsigned int adoptions = 0, rescans = 0;
+  stubFanless = BENCH_FANLESS;
+  terminate = 0;
+  const unsigned long long start = monotonicMs();
+  virtualMs = start;
+  while (virtualMs - start < BENCH_RETRY_HOURS * 3600000ULL) {
+    plugGpus(Fanless, COUNT_OF(Fanless));
+    rescans++;
+    for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+      if (atomic_load(&registry[i].state) == SLOT_FREE ||
+          registry[i].adoptedAt != virtualMs)
+        continue;
+      adoptions++;
+      while (atomic_load(&registry[i].state) == SLOT_ACTIVE)
+        usleep(100);
+    }
+    virtualMs += RESCAN_INTERVAL_MS;
+  }
+  plugGpus(Fanless, 0);
+  const unsigned long long waitMs = retryCount ? retries[0].waitMs : 0;
+  retryCount = 0;
+  stubFanless = 0;
+  virtualMs = 0;
+  const int verified = adoptions > 1 && adoptions * 10 < rescans &&
+                       waitMs == RETRY_MAX_MS;
+  printf("    {\"name\": \"retry_backoff\", \"hours\": %d, \"rescans\": %u, "
+         "\"adoptions\": %u, \"last_wait_s\": %llu, \"verified\": %s},\n",
+         BENCH_RETRY_HOURS, rescans, adoptions, waitMs / 1000,
+         verified ? "true" : "false");
+}
+
+/* Starts three GPUs, pulls the second, adds a fourth and lets the rescan
+ * that follows reap the second's thread, with BENCH_HOTPLUG_MS between
+ * each step. Reports the longest time between two ticks of the GPUs that
+ * stayed, against the steady polling interval, and the time every rescan
+ * took. */
+static void hotplugTrace(void) {
+  static const unsigned int Start[] = {1, 2, 3}, Pulled[] = {1, 3},
+                            Added[] = {1, 3, 4};
+  const unsigned int poll = 1000; // deviceTick() at a steady temperature
+  unsigned long long rescanNs[4];
+  benchTemp = 60;
+  terminate = 0;
+  memset(tickAt, 0, sizeof(tickAt));
+  memset(tickGap, 0, sizeof(tickGap));
+  trackTicks = 1;
+  rescanNs[0] = plugGpus(Start, COUNT_OF(Start));
+  usleep(BENCH_HOTPLUG_MS * 1000);
+  rescanNs[1] = plugGpus(Pulled, COUNT_OF(Pulled));
+  usleep(BENCH_HOTPLUG_MS * 1000);
+  rescanNs[2] = plugGpus(Added, COUNT_OF(Added));
+  usleep(BENCH_HOTPLUG_MS * 1000);
+  rescanNs[3] = plugGpus(Added, COUNT_OF(Added));
+  trackTicks = 0;
+
+  int pulledGone = 1, addedActive = 0;
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    const SlotState state = atomic_load(&registry[i].state);
+    if (state != SLOT_FREE && strcmp(registry[i].uuid, "GPU-bench-1") == 0)
+      pulledGone = 0;
+    if (state == SLOT_ACTIVE && strcmp(registry[i].uuid, "GPU-bench-3") == 0)
+      addedActive = 1;
+  }
+  const unsigned long long gap[] = {atomic_load(&tickGap[1]),
+                                    atomic_load(&tickGap[3])};
+  const unsigned long long allowed =
+      (poll + BENCH_HOTPLUG_SLACK_MS) * 1000000ULL;
+  stopDevices();
+  stubGpuCount = 0;
+  const int verified = pulledGone && addedActive && atomic_load(&tickAt[4]) &&
+                       gap[0] < allowed && gap[1] < allowed;
+  printf("    {\"name\": \"hotplug\", \"poll_ms\": %u, "
+         "\"max_tick_gap_ms\": [%.1f, %.1f], "
+         "\"rescan_us\": [%.1f, %.1f, %.1f, %.1f], \"verified\": %s},\n",
+         poll, gap[0] / 1e6, gap[1] / 1e6, rescanNs[0] / 1e3,
+         rescanNs[1] / 1e3, rescanNs[2] / 1e3, rescanNs[3] / 1e3,
+         verified ? "true" : "false");
+}
+
+/* Restarts BENCH_DEVICES running GPUs as SIGUSR2 does, through
+ * writeHandoff() and loadHandoff() into adoptDevice(), or with a plain stop
+ * and start. Reports the largest fan step away from the speed before the
+ * restart, the firmware's included, until the new devices have ticked. */
+static void restartTrace(const char *name, const int withHandoff) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/handoff", hwmonDir);
+  benchTemp = BENCH_RESTART_TEMP;
+  startDevices();
+  usleep(200000); // past the first ramp steps
+  for (unsigned int i = 0; i < BENCH_FANS; i++)
+    fanRef[i] = simFan[i];
+  atomic_store(&fanStep, 0);
+  trackFans = 1;
+
+  handoff = withHandoff;
+  terminate = 1;
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) != SLOT_FREE)
+      pthread_join(registry[i].thread, NULL);
+  }
+  const int written = withHandoff && writeHandoff(path);
+  for (unsigned int i = 0; i < MAX_DEVICES; i++)
+    atomic_store(&registry[i].state, SLOT_FREE);
+  // From here on this is the new process
+  handoff = 0;
+  terminate = 0;
+  handoffCount = 0;
+  if (withHandoff)
+    loadHandoff(path);
+  const unsigned int resumed = handoffCount;
+  for (unsigned int i = 0; i < BENCH_DEVICES; i++) {
+    char uuid[32];
+    snprintf(uuid, sizeof(uuid), "GPU-bench-%u", i);
+    adoptDevice((nvmlDevice_t)(uintptr_t)(i + 1), i, uuid);
+  }
+  handoffCount = 0;
+  usleep(200000);
+  trackFans = 0;
+  unsigned int after = 0;
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) == SLOT_ACTIVE)
+      after = registry[i].fans[0].prevFanSpeed;
+  }
+  stopDevices();
+  const int verified = !withHandoff || (written && resumed == BENCH_DEVICES &&
+                                        atomic_load(&fanStep) == 0);
+  printf("    {\"name\": \"%s\", \"fan_before\": %u, \"fan_after\": %u, "
+         "\"max_step_percent\": %u, \"verified\": %s},\n",
+         name, fanRef[0], after, atomic_load(&fanStep),
+         verified ? "true" : "false");
+}
+
+/* Fake topology of two sockets: the CPUs this process may run on are split
+ * in half, the first half local to GPU 0 on node 0 and the rest to GPU 1
+ * on node 1. */
+static cpu_set_t stubLocalCpus[2];
+
+static nvmlReturn_t stubGetCpuAffinity(nvmlDevice_t device,
+                                       unsigned int size,
+                                       unsigned long *mask) {
+  const cpu_set_t *local = &stubLocalCpus[((uintptr_t)device - 1) % 2];
+  const unsigned int bits = sizeof(unsigned long) * 8;
+  memset(mask, 0, size * sizeof(unsigned long));
+  for (unsigned int cpu = 0; cpu < size * bits && cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, local))
+      mask[cpu / bits] |= 1UL << (cpu % bits);
+  }
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t stubGetNumaNodeId(nvmlDevice_t device,
+                                      unsigned int *node) {
+  *node = ((uintptr_t)device - 1) % 2;
+  return NVML_SUCCESS;
+}
+
+static void formatCpuList(const cpu_set_t *set, char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+  for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+    if (!CPU_ISSET(cpu, set))
+      continue;
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+      last++;
+    len += snprintf(buf + len, size - len, last > cpu ? "%s%d-%d" : "%s%d",
+                    len ? "," : "", cpu, last);
+    cpu = last;
+  }
+}
+
+/* Where one device loop ran on the fake topology: its affinity after
+ * placement, the CPUs its wakeups ran on, and how many of them moved to
+ * another CPU or ran on the other GPU's node. */
+typedef struct {
+  Device *device;
+  unsigned int node;
+  cpu_set_t placed, ran;
+  unsigned int migrations, crossNode;
+} PlacedRun;
+
+/* Places the device loop as deviceLoop() does, then ticks the device
+ * BENCH_PLACED_WAKEUPS times, BENCH_PLACED_SLEEP_US apart. */
+static void *placedLoop(void *arg) {
+  PlacedRun *run = arg;
+  placeDeviceThread(run->device);
+  pthread_getaffinity_np(pthread_self(), sizeof(run->placed), &run->placed);
+  CPU_ZERO(&run->ran);
+  int last = -1;
+  for (unsigned int i = 0; i < BENCH_PLACED_WAKEUPS; i++) {
+    deviceTick(run->device);
+    const int cpu = sched_getcpu();
+    if (cpu >= 0) {
+      CPU_SET(cpu, &run->ran);
+      run->migrations += last >= 0 && cpu != last;
+      run->crossNode += CPU_ISSET(cpu, &stubLocalCpus[1 - run->node]);
+      last = cpu;
+    }
+    usleep(BENCH_PLACED_SLEEP_US);
+  }
+  return NULL;
+}
+
+/* Runs the device loops of both GPUs of the fake topology side by side,
+ * with the given placement, into runs. */
+static void runPlaced(const int placement, PlacedRun *runs) {
+  static Device devices[2];
+  pthread_t threads[2];
+  int started[2];
+  setupBenchDevice();
+  for (unsigned int d = 0; d < 2; d++) {
+    devices[d] = benchDevice;
+    devices[d].handle = (nvmlDevice_t)(uintptr_t)(d + 1);
+    devices[d].id = d;
+    devices[d].placement = placement;
+    memset(&runs[d], 0, sizeof(runs[d]));
+    runs[d].device = &devices[d];
+    runs[d].node = d;
+    started[d] = pthread_create(&threads[d], NULL, placedLoop, &runs[d]) == 0;
+  }
+  for (unsigned int d = 0; d < 2; d++) {
+    if (started[d])
+      pthread_join(threads[d], NULL);
+  }
+}
+
+/* Runs the device loops of both GPUs of the fake topology with GPU local
+ * placement, and once floating for comparison. The affinity placement
+ * left must be the GPU's local CPUs within HOUSEKEEPING_CPUS if they
+ * overlap, all of its local CPUs if not, or unchanged without any. Reports
+ * the CPUs each loop's wakeups ran on, how often they migrated and how
+ * many ran on the other GPU's node. A placed loop must have none there. */
+static void placementTrace(void) {
+  cpu_set_t online, housekeeping;
+  sched_getaffinity(0, sizeof(online), &online);
+  parseCpuList(HOUSEKEEPING_CPUS, &housekeeping);
+  const int count = CPU_COUNT(&online);
+  int seen = 0;
+  CPU_ZERO(&stubLocalCpus[0]);
+  CPU_ZERO(&stubLocalCpus[1]);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &online))
+      CPU_SET(cpu, &stubLocalCpus[seen++ < (count + 1) / 2 ? 0 : 1]);
+  }
+  nvml.DeviceGetCpuAffinity = stubGetCpuAffinity;
+  nvml.DeviceGetNumaNodeId = stubGetNumaNodeId;
+  terminate = 0;
+
+  PlacedRun floating[2], placed[2];
+  runPlaced(0, floating);
+  runPlaced(2, placed);
+  int verified = 1;
+  char local[2][64], affinity[2][64], ran[2][2][64];
+  for (unsigned int d = 0; d < 2; d++) {
+    cpu_set_t expected;
+    CPU_AND(&expected, &stubLocalCpus[d], &housekeeping);
+    if (!CPU_COUNT(&expected))
+      expected = CPU_COUNT(&stubLocalCpus[d]) ? stubLocalCpus[d] : online;
+    verified &= CPU_EQUAL(&placed[d].placed, &expected) &&
+                (!CPU_COUNT(&stubLocalCpus[d]) || !placed[d].crossNode);
+    formatCpuList(&stubLocalCpus[d], local[d], sizeof(local[d]));
+    formatCpuList(&placed[d].placed, affinity[d], sizeof(affinity[d]));
+    formatCpuList(&floating[d].ran, ran[0][d], sizeof(ran[0][d]));
+    formatCpuList(&placed[d].ran, ran[1][d], sizeof(ran[1][d]));
+  }
+  nvml.DeviceGetCpuAffinity = NULL;
+  nvml.DeviceGetNumaNodeId = NULL;
+  setupBenchDevice();
+  printf("    {\"name\": \"placement\", \"housekeeping\": \"%s\", "
+         "\"wakeups\": %d",
+         HOUSEKEEPING_CPUS, BENCH_PLACED_WAKEUPS);
+  for (unsigned int d = 0; d < 2; d++) {
+    printf(", \"gpu%u_node\": %u, \"gpu%u_local\": \"%s\", "
+           "\"gpu%u_affinity\": \"%s\", \"gpu%u_floating_cpus\": \"%s\", "
+           "\"gpu%u_floating_migrations\": %u, "
+           "\"gpu%u_floating_cross_node\": %u, \"gpu%u_placed_cpus\": \"%s\", "
+           "\"gpu%u_placed_migrations\": %u, \"gpu%u_placed_cross_node\": %u",
+           d, placed[d].node, d, local[d], d, affinity[d], d, ran[0][d], d,
+           floating[d].migrations, d, floating[d].crossNode, d, ran[1][d], d,
+           placed[d].migrations, d, placed[d].crossNode);
+  }
+  printf(", \"verified\": %s},\n", verified ? "true" : "false");
+}
+
+static void unloadNvml(void) {
+  if (nvml.library)
+    dlclose(nvml.library);
+  memset(&nvml, 0, sizeof(nvml));
+}
+
+/* Loads a stub libnvidia-ml through loadNvml() and Init, as nvmlStart()
+ * does, BENCH_NVML_LOADS times, then once more to control its GPUs from
+ * rescanDevices() until the first fan write. Checks that the library loads
+ * only if expected, and that the optional entry points it lacks are left
+ * NULL rather than failing the load. */
+static void nvmlLoad(const char *name, const char *path, const int expected) {
+  unsigned long long total = 0, max = 0;
+  int loaded = 1;
+  benchNvmlLibrary = path;
+  unloadNvml();
+  for (unsigned int i = 0; i < BENCH_NVML_LOADS; i++) {
+    const unsigned long long start = nowNs();
+    const int ok = loadNvml() && nvml.Init() == NVML_SUCCESS;
+    const unsigned long long ns = nowNs() - start;
+    total += ns;
+    if (ns > max)
+      max = ns;
+    loaded &= ok;
+    if (ok)
+      nvml.Shutdown();
+    unloadNvml();
+  }
+
+  unsigned int missing = 0, devices = 0;
+  unsigned long long firstControl = 0;
+  const unsigned long long start = nowNs();
+  if (loaded && loadNvml() && nvml.Init() == NVML_SUCCESS) {
+    for (unsigned int i = 0; i < COUNT_OF(NvmlSymbols); i++)
+      missing += !*NvmlSymbols[i].entry;
+    terminate = 0;
+    devices = rescanDevices();
+    _Atomic unsigned long long *firstWrite =
+        dlsym(nvml.library, "nvmlStubFirstWriteNs");
+    while (devices && firstWrite && !atomic_load(firstWrite) &&
+           nowNs() - start < 1000000000ULL)
+      sched_yield();
+    if (devices && firstWrite && atomic_load(firstWrite))
+      firstControl = atomic_load(firstWrite) - start;
+    stopDevices();
+    nvml.Shutdown();
+  }
+  unloadNvml();
+  stubNvml();
+  benchNvmlLibrary = NULL;
+
+  const int verified =
+      loaded == expected && (!loaded || (devices && firstControl));
+  printf("    {\"name\": \"%s\", \"iterations\": %u, \"ns_per_op\": %.1f, "
+         "\"max_ns\": %llu, \"loaded\": %s, \"optional_missing\": %u, "
+         "\"devices\": %u, \"start_to_first_control_ns\": %llu, "
+         "\"verified\": %s},\n",
+         name, BENCH_NVML_LOADS, (double)total / BENCH_NVML_LOADS, max,
+         loaded ? "true" : "false", missing, devices, firstControl,
+         verified ? "true" : "false");
+}
+
+/* Counts wakeups over BENCH_IDLE_MS of BENCH_DEVICES idle devices, with low
+ * power mode as given. The devices are adopted BENCH_IDLE_STAGGER_MS apart,
+ * as discovery would, so they only share wakeups on the grid. Estimates
+ * the deep C-state residency the controller leaves a CPU that has nothing
+ * else to do: every instant costs its CPU time plus a target residency
+ * that the CPU cannot spend in the deep state. Timer slack lets the kernel
+ * fold the wakeups into other ones, so on a busier host this is the most
+ * they cost. */
+static void idleTrace(const char *name, const int lowPowerOn,
+                      const int last) {
+  lowPower = lowPowerOn;
+  // Steady temperature, so the wakeups are what an idle system pays
+  benchTemp = MIN_TEMP;
+  terminate = 0;
+  for (unsigned int i = 0; i < BENCH_DEVICES; i++) {
+    char uuid[32];
+    snprintf(uuid, sizeof(uuid), "GPU-bench-%u", i);
+    adoptDevice((nvmlDevice_t)(uintptr_t)(i + 1), i, uuid);
+    usleep(BENCH_IDLE_STAGGER_MS * 1000);
+  }
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  const unsigned long long wakeupsBefore = atomic_load(&wakeups);
+  const unsigned long long instantsBefore = atomic_load(&wakeupInstants);
+  usleep(BENCH_IDLE_MS * 1000);
+  getrusage(RUSAGE_SELF, &after);
+  const double seconds = BENCH_IDLE_MS / 1000.0;
+  const unsigned long long idleWakeups = atomic_load(&wakeups) - wakeupsBefore;
+  const unsigned long long idleInstants =
+      atomic_load(&wakeupInstants) - instantsBefore;
+  stopDevices();
+  lowPower = LOW_POWER_MODE;
+  benchTemp = 60;
+
+  const double busyUs =
+      (after.ru_utime.tv_sec - before.ru_utime.tv_sec +
+       after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e6 +
+      after.ru_utime.tv_usec - before.ru_utime.tv_usec +
+      after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+  const double perInstantUs = idleInstants ? busyUs / idleInstants : 0;
+  const double gapMs = idleInstants ? BENCH_IDLE_MS / (double)idleInstants
+                                    : BENCH_IDLE_MS;
+  const double lostUs =
+      idleInstants * (BENCH_CSTATE_RESIDENCY_US + perInstantUs) / seconds;
+  printf("    {\"name\": \"%s\", \"devices\": %d, \"low_power\": %d, "
+         "\"seconds\": %.1f, \"wakeups_per_sec\": %.2f, "
+         "\"wakeup_instants_per_sec\": %.2f, \"timer_slack_us\": %.0f, "
+         "\"busy_us_per_instant\": %.1f, \"mean_idle_gap_ms\": %.1f, "
+         "\"deep_idle_percent\": %.3f}%s\n",
+         name, BENCH_DEVICES, lowPowerOn, seconds, idleWakeups / seconds,
+         idleInstants / seconds,
+         lowPowerOn ? TIMER_SLACK_NS / 1e3 : prctl(PR_GET_TIMERSLACK) / 1e3,
+         perInstantUs, gapMs, 100 - lostUs / 1e4, last ? "" : ",");
+}
+
+static unsigned long procStatusKb(const char *field) {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f)
+    return 0;
+  char line[128];
+  unsigned long kb = 0;
+  const size_t len = strlen(field);
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, field, len) == 0 && line[len] == ':') {
+      kb = strtoul(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+int main(int argc, char **argv) {
+  const unsigned long latencyUs = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+  latencyNs = latencyUs * 1000ULL;
+  stubNvml();
+  setupBenchDevice();
+
+  printf("{\n  \"benchmark\": \"fanController\",\n");
+  printf("  \"nvml_latency_us\": %lu,\n", latencyUs);
+  printf("  \"low_power_mode\": %d,\n", LOW_POWER_MODE);
+  printf("  \"results\": [\n");
+  measure("curve_lookup", benchLookup);
+  measure("table_precompute", benchPrecompute);
+  zeroRpmTrace();
+  hysteresisTrace();
+  measure("tick", benchTick);
+  steadyTrace();
+  precoolOverflow();
+  measure("hint_parse", benchHintParse);
+  measure("hint_ingest", benchHintIngest);
+  makeHwmon();
+  measure("ambient_read", benchAmbientRead);
+  measure("chassis_update", benchChassisUpdate);
+  chassisTrace();
+  bmcTrace();
+  measure("history_record", benchHistoryRecord);
+  historyTrace();
+  measure("flight_record", benchFlightRecord);
+  measure("model_update", benchModelUpdate);
+  measure("mpc_plan", benchMpcPlan);
+  flightTrace();
+  faultTrace("fan_fault_stuck", FAULT_STUCK);
+  faultTrace("fan_fault_lagging", FAULT_LAGGING);
+  faultTrace("fan_fault_stalled", FAULT_STALLED);
+  for (unsigned int i = 0; i < COUNT_OF(SimScenarios); i++)
+    simulate(&SimScenarios[i]);
+  simulateCoupled("sim_pair_uncoupled", 0);
+  simulateCoupled("sim_pair_coupled", 1);
+  modelRestart();
+  restartTrace("restart_handoff", 1);
+  restartTrace("restart_cold", 0);
+  removeHwmon();
+  setupBenchDevice();
+
+  unsigned long long startNs[BENCH_STARTS], stopNs[BENCH_STARTS];
+  for (unsigned int i = 0; i < BENCH_STARTS; i++) {
+    startNs[i] = startDevices();
+    stopNs[i] = stopDevices();
+  }
+  printSamples("start_to_first_control", startNs, BENCH_STARTS);
+  printSamples("shutdown", stopNs, BENCH_STARTS);
+  hotplugTrace();
+  retryTrace();
+  placementTrace();
+  nvmlLoad("nvml_load", "./nvmlStub.so", 1);
+  nvmlLoad("nvml_load_old_driver", "./nvmlStubOld.so", 1);
+  nvmlLoad("nvml_load_broken_driver", "./nvmlStubBroken.so", 0);
+
+  idleTrace("idle", 0, 0);
+  idleTrace("idle_low_power", 1, 1);
+  printf("  ],\n");
+
+  printf("  \"rss_kb\": %lu,\n", procStatusKb("VmRSS"));
+  printf("  \"max_rss_kb\": %lu\n}\n", procStatusKb("VmHWM"));
+  return EXIT_SUCCESS;
+}
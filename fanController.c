@@ -38,11 +38,38 @@
  * ____________________________________________________________________________
 */
 
+#define _GNU_SOURCE
+#include "fanCurve.h"
+#include "history.h"
 #include "nvml.h"
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef DEBUG
@@ -52,253 +79,3300 @@
 #define DEBUG_PRINT(fmt, ...)
 #endif
 
-#define TEMP_THRESHOLD 2 // Degree celcius before action
-#define MIN_TEMP 55      // Lowest value from TempTargets
-#define MAX_TEMP 80      // Highest value from TempTargets
+#ifndef NVML_LIBRARY // the bench loads a stub in its place
+#define NVML_LIBRARY "libnvidia-ml.so.1"
+#endif
+#define NVML_LOAD_TIMEOUT_MS 60000 // Wait this long for the driver library
+#define NVML_LOAD_RETRY_MS 1000    // Between attempts to load it
+
+// MIN_TEMP and MAX_TEMP come from the default curve in fanCurve.spec
+#define TEMP_STEPS (MAX_TEMP - MIN_TEMP + 1)
+
+#define RAMP_UP_RATE 20   // Fan percent per second when speeding up
+#define RAMP_DOWN_RATE 5  // Fan percent per second when slowing down
+#define RAMP_STEP_MS 250  // Interval between intermediate ramp steps
+#define MIN_HOLD_MS 10000 // Hold a reached speed this long before slowing
+
+#define MAX_FANS 8            // Fans controlled per device
+#define ZERO_RPM_STOP_DELTA 5 // Degrees below fan start before fans stop
+
+#define FAN_CHECK_TICKS 10     // Read fans back every this many ticks
+#define FAN_SETTLE_MS 5000     // Time a fan gets to reach a new speed
+#define FAN_LAG_PCT 10         // Off by more than this after settling is lag
+#define FAN_DEGRADED_PCT 5     // Average error above this is degraded
+#define FAN_STALL_CHECKS 2     // Checks at 0 while commanded before stalled
+#define FAN_FALLBACK_MODE 0    // 1 runs the other fans at max while one stalls
+
+#define COUPLED_MODE 0     // 1 lets devices react to their Neighbours
+#define COUPLING_OFFSET 5  // Neighbour temp minus this counts as own temp
+#define COUPLING_SHARE 50  // Percent of a neighbour's fan speed to follow
+#define MAX_NEIGHBOURS 4   // Neighbours considered per device
+
+#define THROTTLE_BOOST_STEP 0 // Fan % added per throttled tick, 0 is off
+#define THROTTLE_HOLD_MS 60000 // Boost kept after slowdown clears, then eased
+/* Headers before the rename to clock events only have the throttle names,
+ * and some later ones still lack the hardware slowdown event. */
+#ifndef nvmlClocksEventReasonGpuIdle
+#define nvmlClocksEventReasonGpuIdle nvmlClocksThrottleReasonGpuIdle
+#endif
+#ifndef nvmlClocksEventReasonSwThermalSlowdown
+#define nvmlClocksEventReasonSwThermalSlowdown                                 \
+  nvmlClocksThrottleReasonSwThermalSlowdown
+#endif
+#ifndef nvmlClocksEventReasonHwThermalSlowdown
+#define nvmlClocksEventReasonHwThermalSlowdown                                 \
+  nvmlClocksThrottleReasonHwThermalSlowdown
+#endif
+/* Clock event reasons that mean the GPU is slowing down because it is hot */
+#define THERMAL_SLOWDOWN                                                       \
+  (nvmlClocksEventReasonSwThermalSlowdown |                                    \
+   nvmlClocksEventReasonHwThermalSlowdown)
+
+#define PERF_MODE 0       // 1 learns boost clock steps and stays below them
+#define PERF_MIN_TEMP 30  // Lowest temperature boost steps are learned at
+#define PERF_MAX_TEMP 90  // Highest temperature boost steps are learned at
+#define PERF_BIN_MHZ 10   // Smallest SM clock drop taken as a boost step
+#define PERF_SAMPLES 3    // Loaded readings at a temperature before it counts
+#define PERF_MARGIN 2     // Degrees kept below the next boost step
+#define PERF_RECLAIM 3    // Steps crossed by less than this are won back
+#define PERF_BOOST_STEP 2 // Fan % added or removed per tick to get there
+#define PERF_DEADBAND 1   // Degrees below the target the boost is held at
+#define PERF_MAX_BOOST 30 // Most fan % spent on top of the curve for a step
+#define PERF_TEMPS (PERF_MAX_TEMP - PERF_MIN_TEMP + 1)
+_Static_assert(PERF_TEMPS <= 64, "boost steps are kept in a 64 bit mask");
+
+#define POWER_CAP_MODE 0              // 1 lowers the power limit at max fan
+#define POWER_CAP_TEMP (MAX_TEMP + 2) // Held with the fans at max, in C
+#define POWER_CAP_RELEASE 2           // Degrees below that to raise it again
+#define POWER_CAP_STEP 2              // % of the original limit per change
+#define POWER_CAP_INTERVAL_MS 2000    // Between two changes
+
+#define PRECOOL_MODE 0        // 1 ramps fans up when a compute process starts
+#define PRECOOL_BOOST 30      // Fan % added for a new process without profile
+#define PRECOOL_MS 30000      // How long that lasts
+#define PROCESS_WATCH_MS 2000 // How often to look for new compute processes
+#define MAX_PROCESSES 32      // Compute processes tracked per device
+
+#define HINT_MODE 0         // 1 accepts scheduler load hints on HINT_SOCKET
+#define HINT_SOCKET "/run/fanController/hints.sock"
+#define HINT_LEAD_MS 15000  // Fans start this long before the hinted load
+#define HINT_BOOST 40       // Fan % added for a hint of the GPU's power limit
+#define HINT_RATED_W 300    // Power limit assumed when NVML reports none
+#define HINT_MAX_MS 3600000 // Longest hint accepted
+#define HINT_POLL_MS 500    // Polling interval while a hint is in effect
+
+#define AMBIENT_MODE 0            // 1 shifts the curve by the inlet temperature
+#define HWMON_ROOT "/sys/class/hwmon"
+#define AMBIENT_REF 25            // Inlet temperature the curve is made for, C
+#define AMBIENT_GAIN 100          // Curve shift in % of the inlet difference
+#define AMBIENT_MAX_SHIFT 10      // Most degrees the curve moves either way
+#define AMBIENT_INTERVAL_MS 30000 // How often the inlet sensors are read
+#define MAX_AMBIENT_SENSORS 8
+
+#define CHASSIS_MODE 0            // 1 drives ChassisFans from the GPUs' heat
+#define CHASSIS_INTERVAL_MS 2000  // How often chassis fans follow the GPUs
+#define CHASSIS_DEADBAND 12       // PWM drops smaller than this are skipped
+#define MAX_CHASSIS_FANS 8
+
+#define BMC_MODE 0            // 1 drives BmcZones through the BMC
+#define BMC_INTERVAL_MS 5000  // Least time between two batches to the BMC
+#define BMC_DEADBAND 5        // Duty % drops smaller than this are skipped
+#define BMC_EXIT_MS 2000      // Time the transport gets to exit at shutdown
+/* ipmitool raw commands as read by its shell, here for Supermicro boards.
+ * BMC_MANUAL goes before the first zone, BMC_RESTORE is sent on exit. */
+#define BMC_MANUAL "raw 0x30 0x45 0x01 0x01"
+#define BMC_SET_ZONE "raw 0x30 0x70 0x66 0x01 0x%02x 0x%02x" // zone, duty
+#define BMC_RESTORE "raw 0x30 0x45 0x01 0x00"
+#define MAX_BMC_ZONES 4
+
+#define HISTORY_MODE 0            // 1 keeps every GPU's history in HISTORY_DIR
+#define HISTORY_INTERVAL_MS 1000  // Between two samples of a GPU
+#define HISTORY_FLUSH_MS 300000   // How often samples are written out
+#define HISTORY_KEEP_DAYS 400     // Daily files older than this are removed
+#define HISTORY_RING 512          // Samples buffered per GPU, a power of 2
+_Static_assert(HISTORY_RING <= HISTORY_MAX_SAMPLES &&
+                   HISTORY_RING * HISTORY_INTERVAL_MS > HISTORY_FLUSH_MS,
+               "HISTORY_RING must hold a flush interval's samples");
+
+#define FLIGHT_MODE 0             // 1 records ticks and dumps thermal events
+#define FLIGHT_DIR "/var/lib/fanController/flight"
+#define FLIGHT_RING 1024          // Ticks kept per GPU, a power of 2
+#define FLIGHT_PRE_MS 120000      // Dumped from before the trigger
+#define FLIGHT_POST_MS 60000      // Captured after the trigger
+#define FLIGHT_FAST_MS 250        // Polling interval while capturing
+#define FLIGHT_SLOPE_C 5          // A rise of this much triggers a capture
+#define FLIGHT_SLOPE_MS 10000     // if it happens within this long
+#define FLIGHT_HOLDOFF_MS 600000  // Least time between captures of a GPU
+_Static_assert(FLIGHT_PRE_MS / RAMP_STEP_MS + FLIGHT_POST_MS / FLIGHT_FAST_MS <
+                   FLIGHT_RING * 3 / 4,
+               "FLIGHT_RING must hold a capture with room to spare");
+
+#define MODEL_MODE 0              // 1 fits a thermal model to every GPU
+#define MODEL_PATH "/var/lib/fanController/thermal-models"
+#define MODEL_INTERVAL_MS 10000   // Span of one fitted step
+#define MODEL_FORGET 0.995        // Weight kept on the past at each step
+#define MODEL_SAVE_MS 600000      // How often the models are saved
+#define MAX_MODELS 64             // GPUs remembered in MODEL_PATH
+
+#define MPC_MODE 0                // 1 plans fan speeds on the thermal model
+#define MPC_CEILING_C 70          // Temperature the plan must stay below
+#define MPC_HORIZON_MS 30000      // How far ahead each tick plans
+#define MPC_STEP_MS 1000          // Resolution of the prediction
+#define MPC_HOLD_MS 10000         // Span of the first move of a plan
+#define MPC_GRID 5                // Fan % between two speeds tried
+#define MPC_TREND_MS 5000         // Smoothing of the power trend
+#define MPC_MIN_UPDATES 30        // Fitted steps before the model is used
+#define MPC_MAX_UNCERTAINTY 0.2   // Relative, for every parameter
+#define MPC_LEVELS (100 / MPC_GRID + 1)
+#define MPC_STEPS (MPC_HORIZON_MS / MPC_STEP_MS)
+#define MPC_HOLD_STEPS (MPC_HOLD_MS / MPC_STEP_MS)
+_Static_assert(MPC_HOLD_STEPS > 0 && MPC_HOLD_STEPS < MPC_STEPS,
+               "MPC_HOLD_MS must fall within MPC_HORIZON_MS");
+_Static_assert(!MPC_MODE || MODEL_MODE, "MPC_MODE needs MODEL_MODE");
+
+#define MAX_DEVICES 16           // GPUs the device registry can hold
+#define RESCAN_INTERVAL_MS 60000 // Look for new or lost GPUs, 0 only on SIGHUP
+#define LOST_READ_FAILURES 5     // Failed reads in a row before retiring a GPU
+#define RETRY_MIN_MS 60000       // Wait before adopting a failed GPU again
+#define RETRY_MAX_MS 3600000     // Longest wait, doubling from RETRY_MIN_MS
+
+#define HANDOFF_PATH "/run/fanController/handoff"
+#define HANDOFF_MAX_AGE_MS 30000 // Older handoff state is ignored
+
+#define LOCK_MEMORY 0                 // 1 mlocks the process after startup
+#define DEVICE_STACK_SIZE (256 * 1024) // Stack of each device thread
+#define CACHE_LINE 64
+
+#define PLACEMENT 0             // 0 floats, 1 housekeeping CPUs, 2 GPU local
+#define HOUSEKEEPING_CPUS "0-1" // CPUs that may run control work, e.g. "0,64"
+#define PAGE_SIZE_HINT 4096     // Device slots are page aligned with 2
+/* With GPU local placement each Device gets its own page so it can be moved
+ * to the GPU's NUMA node. */
+#define DEVICE_ALIGN (PLACEMENT == 2 ? PAGE_SIZE_HINT : CACHE_LINE)
+
+#define LOW_POWER_MODE 0        // 1 coalesces all wakeups onto a shared grid
+#define TIMER_SLACK_NS 50000000 // Timer lateness allowed in low power mode
+#define WAKEUP_GRID_MS 250      // Low power wakeups land on multiples of this
+
+#ifndef STATUS_PATH // the bench writes its own
+#define STATUS_PATH "/run/fanController/fanController.prom"
+#endif
+#define STATUS_INTERVAL_MS 10000 // How often STATUS_PATH is rewritten
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+  unsigned char up[TEMP_STEPS];   // used while heating
+  unsigned char down[TEMP_STEPS]; // used while cooling
+} FanTable;
+
+/* Built from fanCurve.spec at compile time. [0] is the default curve and
+ * [i + 1] belongs to fan FanCurveFans[i]. Fans without a curve of their own
+ * follow the default one. */
+static const FanTable FanSpeeds[] = FAN_CURVE_TABLES;
+static const int FanCurveFans[] = FAN_CURVE_FANS;
+_Static_assert(COUNT_OF(FanSpeeds) == COUNT_OF(FanCurveFans),
+               "fanCurve.h is out of date");
+
+/* NVML entry points, resolved with dlsym when the driver library is loaded
+ * rather than by the dynamic linker at startup. */
+static struct {
+  void *library;
+  __typeof__(nvmlInit_v2) *Init;
+  __typeof__(nvmlShutdown) *Shutdown;
+  __typeof__(nvmlErrorString) *ErrorString;
+  __typeof__(nvmlDeviceGetCount_v2) *DeviceGetCount;
+  __typeof__(nvmlDeviceGetHandleByIndex_v2) *DeviceGetHandleByIndex;
+  __typeof__(nvmlDeviceGetHandleByUUID) *DeviceGetHandleByUUID;
+  __typeof__(nvmlDeviceGetUUID) *DeviceGetUUID;
+  __typeof__(nvmlDeviceGetPciInfo_v3) *DeviceGetPciInfo;
+  __typeof__(nvmlDeviceGetNumFans) *DeviceGetNumFans;
+  __typeof__(nvmlDeviceGetMinMaxFanSpeed) *DeviceGetMinMaxFanSpeed;
+  __typeof__(nvmlDeviceGetTemperature) *DeviceGetTemperature;
+  __typeof__(nvmlDeviceGetFanSpeed_v2) *DeviceGetFanSpeed;
+  __typeof__(nvmlDeviceSetFanSpeed_v2) *DeviceSetFanSpeed;
+  __typeof__(nvmlDeviceSetDefaultFanSpeed_v2) *DeviceSetDefaultFanSpeed;
+  __typeof__(nvmlDeviceGetCpuAffinity) *DeviceGetCpuAffinity;
+  __typeof__(nvmlDeviceGetNumaNodeId) *DeviceGetNumaNodeId;
+  __typeof__(nvmlDeviceGetCurrentClocksEventReasons)
+      *DeviceGetCurrentClocksEventReasons;
+  __typeof__(nvmlDeviceGetClockInfo) *DeviceGetClockInfo;
+  __typeof__(nvmlDeviceGetPowerManagementLimit) *DeviceGetPowerManagementLimit;
+  __typeof__(nvmlDeviceGetPowerManagementLimitConstraints)
+      *DeviceGetPowerManagementLimitConstraints;
+  __typeof__(nvmlDeviceSetPowerManagementLimit) *DeviceSetPowerManagementLimit;
+  __typeof__(nvmlDeviceGetComputeRunningProcesses_v3)
+      *DeviceGetComputeRunningProcesses;
+  __typeof__(nvmlSystemGetProcessName) *SystemGetProcessName;
+  __typeof__(nvmlDeviceGetPowerUsage) *DeviceGetPowerUsage;
+} nvml;
+
+typedef struct {
+  void **entry;
+  const char *names[3]; // preferred version first
+  int optional;         // left NULL when the driver lacks it
+} NvmlSymbol;
+
+static const NvmlSymbol NvmlSymbols[] = {
+    {(void **)&nvml.Init, {"nvmlInit_v2", "nvmlInit"}, 0},
+    {(void **)&nvml.Shutdown, {"nvmlShutdown"}, 0},
+    {(void **)&nvml.ErrorString, {"nvmlErrorString"}, 0},
+    {(void **)&nvml.DeviceGetCount,
+     {"nvmlDeviceGetCount_v2", "nvmlDeviceGetCount"},
+     0},
+    {(void **)&nvml.DeviceGetHandleByIndex,
+     {"nvmlDeviceGetHandleByIndex_v2", "nvmlDeviceGetHandleByIndex"},
+     0},
+    {(void **)&nvml.DeviceGetHandleByUUID, {"nvmlDeviceGetHandleByUUID"}, 0},
+    {(void **)&nvml.DeviceGetUUID, {"nvmlDeviceGetUUID"}, 0},
+    {(void **)&nvml.DeviceGetPciInfo,
+     {"nvmlDeviceGetPciInfo_v3", "nvmlDeviceGetPciInfo_v2"},
+     0},
+    {(void **)&nvml.DeviceGetNumFans, {"nvmlDeviceGetNumFans"}, 0},
+    {(void **)&nvml.DeviceGetMinMaxFanSpeed,
+     {"nvmlDeviceGetMinMaxFanSpeed"},
+     0},
+    {(void **)&nvml.DeviceGetTemperature, {"nvmlDeviceGetTemperature"}, 0},
+    {(void **)&nvml.DeviceGetFanSpeed, {"nvmlDeviceGetFanSpeed_v2"}, 0},
+    {(void **)&nvml.DeviceSetFanSpeed, {"nvmlDeviceSetFanSpeed_v2"}, 0},
+    {(void **)&nvml.DeviceSetDefaultFanSpeed,
+     {"nvmlDeviceSetDefaultFanSpeed_v2"},
+     0},
+    {(void **)&nvml.DeviceGetCpuAffinity, {"nvmlDeviceGetCpuAffinity"}, 1},
+    {(void **)&nvml.DeviceGetNumaNodeId, {"nvmlDeviceGetNumaNodeId"}, 1},
+    {(void **)&nvml.DeviceGetCurrentClocksEventReasons,
+     {"nvmlDeviceGetCurrentClocksEventReasons",
+      "nvmlDeviceGetCurrentClocksThrottleReasons"},
+     1},
+    {(void **)&nvml.DeviceGetClockInfo, {"nvmlDeviceGetClockInfo"}, 1},
+    {(void **)&nvml.DeviceGetPowerManagementLimit,
+     {"nvmlDeviceGetPowerManagementLimit"},
+     1},
+    {(void **)&nvml.DeviceGetPowerManagementLimitConstraints,
+     {"nvmlDeviceGetPowerManagementLimitConstraints"},
+     1},
+    {(void **)&nvml.DeviceSetPowerManagementLimit,
+     {"nvmlDeviceSetPowerManagementLimit"},
+     1},
+    {(void **)&nvml.DeviceGetComputeRunningProcesses,
+     {"nvmlDeviceGetComputeRunningProcesses_v3"},
+     1},
+    {(void **)&nvml.SystemGetProcessName, {"nvmlSystemGetProcessName"}, 1},
+    {(void **)&nvml.DeviceGetPowerUsage, {"nvmlDeviceGetPowerUsage"}, 1},
+};
 
-unsigned int FanSpeeds[MAX_TEMP - MIN_TEMP + 1];
-static unsigned int deviceCount = 0;
 static volatile int terminate = 0;
-static pthread_t *threads = NULL;
+static volatile int rescanRequested = 0;
+static volatile int handoff = 0; // exiting to exec ourselves, keep fans
+static int exitCode = EXIT_SUCCESS;
+/* Every timed wakeup, and the distinct instants they happened at. Threads
+ * sharing an instant cost the CPU a single exit from idle. */
+static _Atomic unsigned long long wakeups = 0;
+static _Atomic unsigned long long wakeupInstants = 0;
+static _Atomic unsigned long long lastWakeInstant = 0;
+static int lowPower = LOW_POWER_MODE; // see onWakeupGrid()
+static unsigned long long hintsAccepted = 0;
+static unsigned long long hintsRejected = 0;
+/* History file of the current day, owned by the main thread */
+static int historyFd = -1;
+static long long historyDay = -1;
+static unsigned long long historySamples = 0;
+static unsigned long long historyBytes = 0;
+static unsigned long long flightDumps = 0;
+/* Inlet sensors, read by the main thread. The device threads only see the
+ * resulting curve shift. */
+static int ambientFds[MAX_AMBIENT_SENSORS];
+static unsigned int ambientCount = 0;
+static int ambientMilli = INT_MIN; // hottest inlet sensor, INT_MIN for none
+static _Atomic int ambientShift = 0; // degrees added to GPU temperatures
 
 typedef struct {
   int id;
+  unsigned int rampUpRate;
+  unsigned int rampDownRate;
+  unsigned int minHoldMs;
+} RampOverride;
+
+// Per device ramp rates. Devices not listed use the RAMP_* defaults.
+static const RampOverride RampOverrides[] = {
+    // {0, 30, 10, 5000}, // device 0: faster ramps, shorter hold
+    {-1, 0, 0, 0}, // terminator
+};
+
+typedef struct {
+  const char *name; // process name without its path
+  unsigned int boost;
+  unsigned int ms;
+} ProcessProfile;
+
+/* Pre-cooling per compute process name, used with PRECOOL_MODE. Processes
+ * not listed get PRECOOL_BOOST for PRECOOL_MS, a boost of 0 ignores them. */
+static const ProcessProfile ProcessProfiles[] = {
+    // {"python3", 40, 60000}, // training jobs: more fan for longer
+    // {"nvidia-cuda-mps-server", 0, 0}, // never pre-cool for this one
+    {NULL, 0, 0}, // terminator
+};
+
+typedef struct {
+  const char *chip;  // hwmon name
+  const char *label; // tempN_label, NULL for every temperature of the chip
+} AmbientSensor;
+
+/* Inlet or ambient sensors in HWMON_ROOT, used with AMBIENT_MODE. With none
+ * listed, temperatures of any chip labelled inlet or ambient are used. */
+static const AmbientSensor AmbientSensors[] = {
+    // {"nct6798", "SYSTIN"}, // motherboard sensor at the front intake
+    {NULL, NULL}, // terminator
+};
+
+typedef enum { CHASSIS_MAX_TEMP, CHASSIS_SUM_POWER } ChassisSource;
+
+typedef struct {
+  const char *chip;     // hwmon name
+  unsigned int pwm;     // N of pwmN
+  ChassisSource source; // hottest GPU in C, or all GPUs together in W
+  unsigned int from;    // at or below this the fan runs at minPwm
+  unsigned int to;      // at or above this it runs at maxPwm
+  unsigned int minPwm;  // 0-255
+  unsigned int maxPwm;
+} ChassisFan;
+
+/* Chassis fans on hwmon PWM outputs in HWMON_ROOT, used with CHASSIS_MODE.
+ * Each follows a straight line between its two points. */
+static const ChassisFan ChassisFans[] = {
+    // {"nct6798", 2, CHASSIS_MAX_TEMP, 45, 80, 80, 255},    // front intake
+    // {"nct6798", 3, CHASSIS_SUM_POWER, 200, 1400, 60, 255}, // rear exhaust
+    {NULL, 0, 0, 0, 0, 0, 0}, // terminator
+};
+
+typedef struct {
+  const char *name;     // for the status
+  unsigned int zone;    // BMC fan zone
+  ChassisSource source; // as for chassis fans
+  unsigned int from;
+  unsigned int to;
+  unsigned int minDuty; // %
+  unsigned int maxDuty;
+} BmcZone;
+
+/* Fan zones of the BMC, used with BMC_MODE on servers whose GPUs are cooled
+ * by the chassis fans alone. */
+static const BmcZone BmcZones[] = {
+    // {"system", 0, CHASSIS_MAX_TEMP, 45, 80, 30, 100},
+    // {"peripheral", 1, CHASSIS_SUM_POWER, 300, 2400, 30, 100}, // GPU cage
+    {NULL, 0, 0, 0, 0, 0, 0}, // terminator
+};
+
+/* Talks to the BMC: a long running process reading one command per line on
+ * its stdin, given the commands above. */
+static char *const BmcTransport[] = {"ipmitool", "-I", "open", "shell", NULL};
+
+typedef struct {
+  const ChassisFan *fan;
+  int pwmFd;    // pwmN, kept open for writing
+  int enableFd; // pwmN_enable
+  int enable;   // pwmN_enable as found, restored on exit
+  int pwmOrig;  // pwmN as found
+  int pwm;      // last written, -1 before the first write
+  unsigned long long writes;
+} ChassisState;
+
+/* Chassis fans, owned by the main thread. Device threads only publish
+ * their power draw when a chassis fan follows it. */
+static ChassisState chassis[MAX_CHASSIS_FANS];
+static unsigned int chassisCount = 0;
+static int chassisPower = 0;
+
+/* The BMC transport, owned by the main thread. Commands are only written,
+ * so a slow BMC never holds up the main thread. */
+static struct {
+  char *const *argv;
+  const BmcZone *zones;
+  unsigned int zoneCount;
+  int fd; // the transport's stdin, -1 while not running
+  pid_t pid;
+  int manual;              // BMC_MANUAL went to this transport
+  int duty[MAX_BMC_ZONES]; // last sent, -1 before
+  unsigned long long batches;
+  unsigned long long commands;
+  unsigned long long errors;
+} bmc = {.fd = -1};
+
+typedef struct {
+  const char *busId;          // this device
+  const char *neighbourBusId; // heats up this device
+} Adjacency;
+
+/* Airflow neighbours by PCI bus ID as nvidia-smi reports it, used with
+ * COUPLED_MODE. List both directions if both cards heat each other. */
+static const Adjacency Neighbours[] = {
+    // {"00000000:02:00.0", "00000000:01:00.0"}, // 02 is downstream of 01
+    {NULL, NULL}, // terminator
+};
+
+typedef enum { FAN_OK, FAN_LAG, FAN_DEGRADED, FAN_STALLED } FanHealth;
+
+static const char *FanHealthNames[] = {"ok", "lag", "degraded", "stalled"};
+
+/* What started a flight recorder capture */
+typedef enum { FLIGHT_SLOPE, FLIGHT_THROTTLE, FLIGHT_FAN } FlightReason;
+
+static const char *FlightReasonNames[] = {"slope", "throttle", "fan"};
+
+/* One tick as kept by the flight recorder */
+typedef struct {
+  unsigned long long ms; // monotonic
+  unsigned char temperature;
+  unsigned char controlTemp; // after coupling and the inlet shift
+  unsigned char fan;         // highest commanded fan %
+  unsigned char boost;       // fan % added on top of the curve
+  unsigned char flags;       // FLIGHT_SLOWDOWN, FLIGHT_RAMPING
+} FlightSample;
+
+#define FLIGHT_SLOWDOWN 1
+#define FLIGHT_RAMPING 2
+
+/* First order thermal model of a GPU and its cooler:
+ *
+ *   C dT/dt = P - (G0 + G1 f) (T - Ta)
+ *
+ * with the heat capacity C in J/C, the power P in W, the conductance G0
+ * with the fans stopped and G1 added at full speed in W/C, the average
+ * commanded fan speed f from 0 to 1 and the air temperature Ta. With Ta in
+ * the fan term taken from the previous fit it is linear in theta for the
+ * regressors
+ *
+ *   x = (P/S, -T/S, -f (T - Ta)/S, 1)
+ *   theta = (S/C, S G0/C, S G1/C, G0 Ta/C)
+ *
+ * scaled by S so that all are near 1, which recursive least squares fits
+ * with cov as the covariance of theta over the noise variance. Fitting Ta
+ * twice, once per term, would leave it free to drift between them. */
+#define MODEL_PARAMS 4
+#define MODEL_SCALE 100.0
+#define MODEL_PRIOR_COV 10.0 // also bounds the trace, see updateModel()
+
+typedef struct {
+  double theta[MODEL_PARAMS];
+  double cov[MODEL_PARAMS][MODEL_PARAMS];
+  double noise; // mean squared prediction error, (C/s)^2
+  unsigned long long updates;
+} ThermalModel;
+
+/* Physical parameters of a model, or their relative uncertainties */
+typedef struct {
+  double capacity;    // J/C
+  double conductance; // W/C with the fans stopped
+  double fanGain;     // W/C added at full fan speed
+  double ambient;     // C
+} ModelParams;
+
+typedef struct {
+  FanTable table; // curve clamped to this fan's range, 0 is stopped
   unsigned int prevFanSpeed;
+  unsigned int targetFanSpeed;
+  unsigned long long holdUntil;
+  unsigned long long changedAt;
+  /* Readback statistics */
+  unsigned int actualFanSpeed;
+  unsigned int errorAvg16; // rolling average of |commanded - actual| * 16
+  unsigned int zeroChecks;
+  unsigned int checks;
+  unsigned int lagCount;
+  unsigned int stallCount;
+  unsigned int degradedCount;
+  FanHealth health;
+} Fan;
+
+/* Control state carried across a handoff restart, see writeHandoff(). */
+typedef struct {
+  char uuid[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+  unsigned int prevTemperature;
+  unsigned int fanCount;
+  unsigned int powerLimit; // mW to restore on exit, 0 if not capping
+  struct {
+    unsigned int prevFanSpeed;
+    unsigned int targetFanSpeed;
+    unsigned long long holdUntil;
+    unsigned long long changedAt;
+    unsigned int errorAvg16;
+    unsigned int checks;
+    unsigned int lagCount;
+    unsigned int stallCount;
+    unsigned int degradedCount;
+    unsigned int health;
+  } fans[MAX_FANS];
+} HandoffState;
+
+static HandoffState handoffStates[MAX_DEVICES];
+static unsigned int handoffCount = 0;
+
+typedef enum { SLOT_FREE, SLOT_ACTIVE, SLOT_EXITED } SlotState;
+
+typedef struct {
+  /* Registry, owned by the main thread */
+  _Atomic int state; // SlotState, SLOT_EXITED is set by the device thread
+  volatile int retire;
+  int failed; // the thread gave up on the GPU, set before SLOT_EXITED
+  unsigned long long adoptedAt;
+  pthread_t thread;
+  char uuid[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+  char busId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
+  const HandoffState *handoff; // state to resume from, if any
+  /* Load hint from the scheduler, written by the main thread */
+  _Atomic unsigned int hintWatts;
+  _Atomic unsigned long long hintStart; // monotonic ms
+  _Atomic unsigned long long hintEnd;
+  _Atomic unsigned int historyTail; // next sample to write out
+  /* Control state, owned by the device thread */
+  _Alignas(DEVICE_ALIGN) int id; // NVML index when adopted
   unsigned int prevTemperature;
+  unsigned int rampUpRate;
+  unsigned int rampDownRate;
+  unsigned int minHoldMs;
+  unsigned int minFanSpeed;
+  unsigned int maxFanSpeed;
   nvmlDevice_t handle;
   unsigned int fanCount;
+  Fan fans[MAX_FANS];
+  unsigned int neighbours[MAX_NEIGHBOURS]; // registry slots
+  unsigned int neighbourCount;
+  unsigned int neighbourGeneration;
+  unsigned int tick;
+  unsigned int stalledFans; // see checkFans()
+  int fallbackMode;          // FAN_FALLBACK_MODE
+  unsigned int failures; // temperature reads failed in a row
+  int placement;         // PLACEMENT of this device's thread
+  unsigned int throttleStep;         // THROTTLE_BOOST_STEP
+  unsigned int throttleBoost;        // fan % added on top of the curve
+  unsigned int throttleEvents;       // times thermal slowdown started
+  unsigned long long throttledSince; // 0 while not throttled
+  unsigned long long throttledMs;    // finished throttle periods
+  unsigned long long throttleHeldAt; // when the last slowdown cleared
+  int perfMode;
+  unsigned int perfBoost; // fan % added to stay below a boost step
+  unsigned int smClock;   // MHz, 0 while idle
+  /* Highest SM clock seen under load per degree from PERF_MIN_TEMP, and the
+   * temperatures where it drops a bin as a mask over the same range. */
+  unsigned short perfClock[PERF_TEMPS];
+  unsigned char perfSamples[PERF_TEMPS];
+  unsigned long long perfSteps;
+  unsigned int powerLimit;       // mW, as currently set
+  unsigned int powerLimitOrig;   // mW to restore, 0 while not capping
+  unsigned int powerLimitMin;    // mW, lowest the card accepts
+  unsigned long long powerCapAt; // last change of the limit
+  int precoolMode;
+  unsigned int precoolBoost;         // fan % added for a new process
+  unsigned long long precoolUntil;   // when that boost ends
+  unsigned int precoolEvents;        // processes that started a boost
+  unsigned long long processCheckAt; // last look at the process list
+  unsigned int pids[MAX_PROCESSES];  // compute processes seen last time
+  unsigned int pidCount;
+  int pidsKnown; // processes running at startup do not count as new
+  unsigned int processCount; // all of them, even past MAX_PROCESSES
+  int processOverflow;       // more than MAX_PROCESSES were logged
+  unsigned int powerRated; // mW, what hints are scaled against
+  unsigned int hintBoost;  // fan % added for the current hint
+  /* Thermal model fitted by trackModel(), published through modelSeq */
+  int modelMode;
+  ThermalModel model;
+  double modelX[MODEL_PARAMS];    // regressors since modelAt
+  double modelSums[MODEL_PARAMS]; // regressors integrated over the step
+  unsigned long long modelStart;  // start of the step, 0 to restart
+  unsigned long long modelAt;     // last tick
+  unsigned int modelTemp;         // temperature at modelStart
+  /* Model-predictive control, see planFanSpeed(). The tables hold per fan
+   * speed of the plan the temperature's decay over MPC_STEP_MS and the
+   * degrees of heating per W, rebuilt from each new fit of the model. */
+  int mpcMode;
+  int mpcPlan;                     // fan % planned, -1 while on the curve
+  unsigned long long mpcUpdates;   // model.updates the tables are for
+  unsigned int mpcLevels;          // speeds tried, 0 while not trusted
+  unsigned int mpcSpeeds[MPC_LEVELS];
+  double mpcDecay[MPC_LEVELS];
+  double mpcHeating[MPC_LEVELS];   // C/W at equilibrium
+  double mpcEffort[MPC_LEVELS];    // fan power, cubic in speed
+  double mpcAmbient;               // C
+  double mpcPower;                 // W at mpcAt
+  double mpcTrend;                 // W/s
+  unsigned long long mpcAt;
+  /* Flight recorder, see recordFlight(). A finished capture is described by
+   * flightReason to flightEnd and handed over through flightReady. */
+  int flightMode;
+  FlightSample flight[FLIGHT_RING];
+  unsigned long long flightUntil;   // end of the capture, 0 when idle
+  unsigned long long flightHoldoff; // no capture starts before this
+  unsigned long long flightBaseAt;  // baseline of the slope trigger
+  unsigned int flightBase;
+  FlightReason flightReason;
+  unsigned long long flightAt;  // when the trigger fired
+  unsigned int flightTrigger;   // first sample after the trigger
+  unsigned int flightEnd;       // sample after the capture
+  unsigned int flightTriggers[COUNT_OF(FlightReasonNames)];
+  /* Samples for the history with monotonic timestamps, see recordHistory() */
+  HistorySample history[HISTORY_RING];
+  unsigned long long historyAt; // last sample
+  unsigned int historyDropped;  // samples lost to a full ring
+  /* Last temperature << 16 | highest fan target, read by other devices */
+  _Alignas(CACHE_LINE) _Atomic unsigned int snapshot;
+  _Atomic unsigned int power; // mW, only read with chassisPower
+  _Atomic unsigned int historyHead; // next free slot in history
+  _Atomic unsigned int flightHead;  // next slot in flight
+  _Atomic int flightReady;          // capture to dump, cleared once dumped
+  _Atomic unsigned int modelSeq;    // odd while model is being updated
 } Device;
 
-void runTimeSanity(const unsigned int *TempTargets,
-                   const unsigned int *FanTargets,
-                   const unsigned int CountTargets) {
-  // Runtime sanity checks. These are here to protect you.
-  if (MIN_TEMP != TempTargets[0]) {
-    DEBUG_PRINT("ERROR: MIN_TEMP does not align with TempTargets.\n");
-    exit(EXIT_FAILURE);
+/* Devices are keyed by UUID. Slots are only reused after their thread has
+ * been joined, and registryGeneration changes whenever a slot does. The
+ * registry is static and every Device starts on its own cache line, so the
+ * control path never allocates and threads never share a written line. */
+static Device registry[MAX_DEVICES];
+static _Atomic unsigned int registryGeneration = 0;
+
+/* GPUs whose thread gave up on them, owned by the main thread. Each is
+ * adopted again once retryAt has passed, see delayRetry(). */
+typedef struct {
+  char uuid[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+  unsigned long long waitMs;
+  unsigned long long retryAt; // monotonic ms
+} RetryState;
+
+static RetryState retries[MAX_DEVICES];
+static unsigned int retryCount = 0;
+
+static int readNumber(const int fd, int *value) {
+  char buf[16];
+  const ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  *value = atoi(buf);
+  return 1;
+}
+
+static int writeNumber(const int fd, const int value) {
+  char buf[16];
+  const int len = snprintf(buf, sizeof(buf), "%d\n", value);
+  return pwrite(fd, buf, len, 0) == len;
+}
+
+/* Hands the chassis fans back as they were found. Also done before a
+ * handoff exec, the next process takes them over again right away. */
+static void restoreChassisFans(void) {
+  for (unsigned int i = 0; i < chassisCount; i++) {
+    const ChassisState *c = &chassis[i];
+    if (!writeNumber(c->pwmFd, c->pwmOrig) ||
+        !writeNumber(c->enableFd, c->enable))
+      DEBUG_PRINT("Failed to restore chassis fan %s pwm%u\n", c->fan->chip,
+                  c->fan->pwm);
+  }
+}
+
+/* Hands the fans back to the BMC and lets the transport exit at the end of
+ * its input. One that is still running after BMC_EXIT_MS is killed. */
+static void stopBmc(void) {
+  if (bmc.fd < 0)
+    return;
+  if (bmc.manual && send(bmc.fd, BMC_RESTORE "\n", sizeof(BMC_RESTORE),
+                         MSG_NOSIGNAL) != sizeof(BMC_RESTORE))
+    DEBUG_PRINT("Failed to hand the fans back to the BMC\n");
+  close(bmc.fd);
+  bmc.fd = -1;
+  bmc.manual = 0;
+  for (unsigned int i = 0; i < MAX_BMC_ZONES; i++)
+    bmc.duty[i] = -1;
+  for (unsigned int ms = 0; waitpid(bmc.pid, NULL, WNOHANG) == 0; ms += 50) {
+    if (ms >= BMC_EXIT_MS) {
+      DEBUG_PRINT("BMC transport did not exit, killing it\n");
+      kill(bmc.pid, SIGKILL);
+      waitpid(bmc.pid, NULL, 0);
+      break;
+    }
+    usleep(50000);
+  }
+}
+
+static unsigned long long monotonicMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Drops a block cut short by a crash at the end of a history file, so the
+ * blocks appended after it can be read. */
+static void repairHistory(const int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+    return;
+  const unsigned char *data =
+      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return;
+  const unsigned char *p = data, *end = data + st.st_size, *samples;
+  HistoryBlock block;
+  while ((samples = historyNext(p, end, &block)))
+    p = samples + block.size;
+  munmap((void *)data, st.st_size);
+  if (p != end) {
+    DEBUG_PRINT("Dropping %zd bytes cut short in history\n", end - p);
+    if (ftruncate(fd, p - data) != 0)
+      DEBUG_PRINT("Failed to truncate history\n");
+  }
+}
+
+/* Removes daily files older than HISTORY_KEEP_DAYS. */
+static void pruneHistory(const char *dir, const long long today) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    const long long day = historyFileDay(entry->d_name);
+    if (day >= 0 && day < today - HISTORY_KEEP_DAYS &&
+        unlinkat(dirfd(d), entry->d_name, 0) == 0)
+      DEBUG_PRINT("Removed history %s\n", entry->d_name);
+  }
+  closedir(d);
+}
+
+/* Makes historyFd the file of the given day, rotating at UTC midnight. */
+static int openHistory(const char *dir, const long long day) {
+  if (historyFd >= 0 && day == historyDay)
+    return 1;
+  if (historyFd >= 0)
+    close(historyFd);
+  char name[64], path[PATH_MAX];
+  historyFileName(name, sizeof(name), day);
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  historyFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (historyFd < 0) {
+    DEBUG_PRINT("Failed to open %s\n", path);
+    return 0;
+  }
+  historyDay = day;
+  repairHistory(historyFd);
+  pruneHistory(dir, day);
+  return 1;
+}
+
+/* Writes what a device recorded since the last flush as one block to the
+ * file of the day the block starts on. Monotonic timestamps become wall
+ * clock ones here. Runs on the main thread. */
+static void flushDeviceHistory(const char *dir, Device *device) {
+  static HistorySample samples[HISTORY_RING];
+  static unsigned char block[HISTORY_BLOCK_MAX];
+  const unsigned int head =
+      atomic_load_explicit(&device->historyHead, memory_order_acquire);
+  const unsigned int tail =
+      atomic_load_explicit(&device->historyTail, memory_order_relaxed);
+  const unsigned int count = head - tail;
+  if (!count)
+    return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const long long offset = (long long)ts.tv_sec * 1000 +
+                           ts.tv_nsec / 1000000 - (long long)monotonicMs();
+  for (unsigned int i = 0; i < count; i++) {
+    samples[i] = device->history[(tail + i) % HISTORY_RING];
+    samples[i].ms += offset;
+  }
+  atomic_store_explicit(&device->historyTail, head, memory_order_release);
+
+  const size_t length = historyEncode(device->uuid, samples, count, block);
+  if (!openHistory(dir, samples[0].ms / HISTORY_DAY_MS) ||
+      write(historyFd, block, length) != (ssize_t)length) {
+    DEBUG_PRINT("Failed to write history of device %d\n", device->id);
+    return;
+  }
+  historySamples += count;
+  historyBytes += length;
+}
+
+/* Flushes every device, every HISTORY_FLUSH_MS and before a handoff. */
+static void flushHistory(const char *dir) {
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    if (atomic_load(&registry[d].state) != SLOT_FREE)
+      flushDeviceHistory(dir, &registry[d]);
+  }
+}
+
+/* Writes a finished capture as CSV to FLIGHT_DIR, from FLIGHT_PRE_MS before
+ * its trigger to its end, with times relative to the trigger. The device
+ * keeps recording meanwhile; the ring is sized so that it does not reach
+ * the capture before the main thread gets to it. */
+static void dumpFlight(const char *dir, Device *device) {
+  if (!atomic_load_explicit(&device->flightReady, memory_order_acquire))
+    return;
+  const unsigned int head =
+      atomic_load_explicit(&device->flightHead, memory_order_acquire);
+  // Keep clear of the slots the device writes next
+  const unsigned int oldest =
+      head > FLIGHT_RING * 7 / 8 ? head - FLIGHT_RING * 7 / 8 : 0;
+  const unsigned long long at = device->flightAt;
+  unsigned int start =
+      device->flightTrigger > oldest ? device->flightTrigger : oldest;
+  while (start > oldest &&
+         device->flight[(start - 1) % FLIGHT_RING].ms + FLIGHT_PRE_MS >= at)
+    start--;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const time_t wall = ts.tv_sec - (monotonicMs() - at) / 1000;
+  struct tm tm;
+  char stamp[32], path[PATH_MAX];
+  gmtime_r(&wall, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+  snprintf(path, sizeof(path), "%s/flight-%s-%s.csv", dir, device->uuid,
+           stamp);
+  FILE *f = fopen(path, "w");
+  if (f) {
+    fprintf(f, "# %s %s\n", device->uuid,
+            FlightReasonNames[device->flightReason]);
+    fprintf(f, "ms,temperature,control_temperature,fan,boost,slowdown,"
+               "ramping\n");
+    for (unsigned int i = start; i < device->flightEnd; i++) {
+      const FlightSample *s = &device->flight[i % FLIGHT_RING];
+      fprintf(f, "%lld,%u,%u,%u,%u,%d,%d\n", (long long)(s->ms - at),
+              s->temperature, s->controlTemp, s->fan, s->boost,
+              !!(s->flags & FLIGHT_SLOWDOWN), !!(s->flags & FLIGHT_RAMPING));
+    }
+    fclose(f);
+    flightDumps++;
+    DEBUG_PRINT("Dumped %u samples of device %d to %s\n",
+                device->flightEnd - start, device->id, path);
+  } else {
+    DEBUG_PRINT("Failed to write %s\n", path);
+  }
+  atomic_store_explicit(&device->flightReady, 0, memory_order_release);
+}
+
+static void dumpFlights(const char *dir) {
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    if (atomic_load(&registry[d].state) != SLOT_FREE)
+      dumpFlight(dir, &registry[d]);
+  }
+}
+
+/* Copies a device's model, retrying while the device updates it. */
+static void readModel(const Device *device, ThermalModel *out) {
+  unsigned int seq;
+  do {
+    seq = atomic_load_explicit(&device->modelSeq, memory_order_acquire);
+    memcpy(out, &device->model, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+           seq != atomic_load_explicit(&device->modelSeq,
+                                       memory_order_relaxed));
+}
+
+/* Physical parameters of a model and, from the diagonal of its covariance,
+ * roughly how uncertain each is relative to its value. */
+static void modelParams(const ThermalModel *m, ModelParams *p,
+                        ModelParams *uncertainty) {
+  const double *t = m->theta;
+  double rel[MODEL_PARAMS];
+  for (unsigned int i = 0; i < MODEL_PARAMS; i++)
+    rel[i] = t[i] != 0 ? sqrt(fabs(m->cov[i][i]) * m->noise) / fabs(t[i])
+                       : INFINITY;
+  p->capacity = MODEL_SCALE / t[0];
+  p->conductance = t[1] / t[0];
+  p->fanGain = t[2] / t[0];
+  p->ambient = MODEL_SCALE * t[3] / t[1];
+  uncertainty->capacity = rel[0];
+  uncertainty->conductance = hypot(rel[1], rel[0]);
+  uncertainty->fanGain = hypot(rel[2], rel[0]);
+  uncertainty->ambient = hypot(rel[3], rel[1]);
+}
+
+/* Models kept across restarts, keyed by UUID and bus ID since the slot a
+ * card sits in changes its airflow. Owned by the main thread. */
+typedef struct {
+  char uuid[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+  char busId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
+  ThermalModel model;
+} ModelRecord;
+
+static ModelRecord models[MAX_MODELS];
+static unsigned int modelCount = 0;
+
+static ModelRecord *findModel(const char *uuid, const char *busId) {
+  for (unsigned int i = 0; i < modelCount; i++) {
+    if (strcmp(models[i].uuid, uuid) == 0 &&
+        strcmp(models[i].busId, busId) == 0)
+      return &models[i];
   }
-  if (MAX_TEMP != TempTargets[CountTargets - 1]) {
-    DEBUG_PRINT("ERROR: MAX_TEMP does not align with TempTargets.\n");
-    exit(EXIT_FAILURE);
+  return NULL;
+}
+
+/* Takes a device's current model into the records, to be saved. */
+static void storeModel(const Device *device) {
+  if (!device->modelMode || !device->busId[0])
+    return;
+  ModelRecord *r = findModel(device->uuid, device->busId);
+  if (!r && modelCount == MAX_MODELS) {
+    DEBUG_PRINT("No room to keep the model of device %d\n", device->id);
+    return;
   }
-  if (TempTargets[CountTargets - 1] > 90) {
-    DEBUG_PRINT("ERROR: TempTargets maximum must not exceed 90\n");
-    exit(EXIT_FAILURE);
+  if (!r) {
+    r = &models[modelCount++];
+    snprintf(r->uuid, sizeof(r->uuid), "%s", device->uuid);
+    snprintf(r->busId, sizeof(r->busId), "%s", device->busId);
   }
-  if (FanTargets[CountTargets - 1] > 100) {
-    DEBUG_PRINT("ERROR: FanTargets maximum must not exceed 100\n");
-    exit(EXIT_FAILURE);
+  readModel(device, &r->model);
+}
+
+static void writeModels(const char *path) {
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *f = fopen(tmpPath, "w");
+  if (!f) {
+    DEBUG_PRINT("Failed to open %s\n", tmpPath);
+    return;
   }
-  for (unsigned int i = 0; i < CountTargets - 1; i++) {
-    if (FanTargets[i + 1] < FanTargets[i]) {
-      DEBUG_PRINT("ERROR: FanTargets must be ordered min to max\n");
-      exit(EXIT_FAILURE);
+  fprintf(f, "fanController-models 1\n");
+  for (unsigned int r = 0; r < modelCount; r++) {
+    const ThermalModel *m = &models[r].model;
+    fprintf(f, "model %s %s %llu %.17g", models[r].uuid, models[r].busId,
+            m->updates, m->noise);
+    for (unsigned int i = 0; i < MODEL_PARAMS; i++)
+      fprintf(f, " %.17g", m->theta[i]);
+    for (unsigned int i = 0; i < MODEL_PARAMS; i++) {
+      for (unsigned int j = 0; j < MODEL_PARAMS; j++)
+        fprintf(f, " %.17g", m->cov[i][j]);
     }
-    if (TempTargets[i + 1] < TempTargets[i]) {
-      DEBUG_PRINT("ERROR: TempTargets must be ordered min to max\n");
-      exit(EXIT_FAILURE);
+    fprintf(f, "\n");
+  }
+  if (fclose(f) != 0 || rename(tmpPath, path) != 0) {
+    DEBUG_PRINT("Failed to write %s\n", path);
+    unlink(tmpPath);
+  }
+}
+
+static void saveModels(const char *path) {
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    if (atomic_load(&registry[d].state) != SLOT_FREE)
+      storeModel(&registry[d]);
+  }
+  writeModels(path);
+}
+
+/* Reads what writeModels() saved. Devices adopted later start from their
+ * record. */
+static void loadModels(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  unsigned int version;
+  if (fscanf(f, "fanController-models %u", &version) != 1 || version != 1) {
+    DEBUG_PRINT("Ignoring unknown models in %s\n", path);
+    fclose(f);
+    return;
+  }
+  while (modelCount < MAX_MODELS) {
+    ModelRecord *r = &models[modelCount];
+    ThermalModel *m = &r->model;
+    if (fscanf(f, " model %95s %31s %llu %lg", r->uuid, r->busId, &m->updates,
+               &m->noise) != 4)
+      break;
+    double *values[MODEL_PARAMS * (MODEL_PARAMS + 1)];
+    unsigned int i;
+    for (i = 0; i < MODEL_PARAMS; i++)
+      values[i] = &m->theta[i];
+    for (i = 0; i < MODEL_PARAMS * MODEL_PARAMS; i++)
+      values[MODEL_PARAMS + i] = &m->cov[i / MODEL_PARAMS][i % MODEL_PARAMS];
+    for (i = 0; i < COUNT_OF(values); i++) {
+      if (fscanf(f, " %lg", values[i]) != 1)
+        break;
     }
+    if (i != COUNT_OF(values))
+      break;
+    modelCount++;
   }
+  fclose(f);
+  DEBUG_PRINT("Loaded %u thermal models\n", modelCount);
 }
 
 void cleanup(const int signum) {
   terminate = 1;
-  if (threads) {
-    for (unsigned int i = 0; i < deviceCount; i++) {
-      pthread_join(threads[i], NULL);
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) != SLOT_FREE) {
+      pthread_join(registry[i].thread, NULL);
+      if (HISTORY_MODE)
+        flushDeviceHistory(HISTORY_DIR, &registry[i]);
+      if (FLIGHT_MODE)
+        dumpFlight(FLIGHT_DIR, &registry[i]);
+      if (MODEL_MODE)
+        storeModel(&registry[i]);
+      atomic_store(&registry[i].state, SLOT_FREE);
     }
-    free(threads);
-    threads = NULL;
   }
-  nvmlShutdown();
+  if (MODEL_MODE)
+    writeModels(MODEL_PATH);
+  if (!handoff) {
+    unlink(STATUS_PATH);
+    if (HINT_MODE)
+      unlink(HINT_SOCKET);
+  }
+  restoreChassisFans();
+  stopBmc();
+  if (nvml.Shutdown)
+    nvml.Shutdown();
   DEBUG_PRINT("Shutdown Complete\n");
   exit(signum);
 }
 
+/* Device threads block these signals, so this always runs on the main thread
+ * which then shuts down outside of signal context. */
 void signal_handler(const int signum) {
-  DEBUG_PRINT("Received signal %d, shutting down...\n", signum);
-  cleanup(signum);
-}
-
-static unsigned int fanspeedFromT(const unsigned int temperature,
-                                  const unsigned int *slopes,
-                                  const unsigned int *TempTargets,
-                                  const unsigned int *FanTargets,
-                                  const unsigned int CountTargets) {
-  if (CountTargets == 1)
-    return FanTargets[0];
-  if (temperature <= TempTargets[0])
-    return FanTargets[0];
-  if (temperature >= TempTargets[CountTargets - 1])
-    return FanTargets[CountTargets - 1];
-
-  int i;
-  for (i = 0; temperature > TempTargets[i]; i++) {
-    continue;
+  if (signum == SIGHUP) {
+    rescanRequested = 1;
+    return;
   }
-  return FanTargets[i - 1] +
-         ((temperature - TempTargets[i - 1]) * slopes[i - 1]) / 100;
+  if (signum == SIGUSR2) {
+    DEBUG_PRINT("Received signal %d, handing off...\n", signum);
+    handoff = 1;
+    terminate = 1;
+    return;
+  }
+  DEBUG_PRINT("Received signal %d, shutting down...\n", signum);
+  exitCode = signum;
+  terminate = 1;
+}
+
+static unsigned int clampFanSpeed(const unsigned int speed,
+                                  const unsigned int min,
+                                  const unsigned int max) {
+  if (speed < min)
+    return min;
+  if (speed > max)
+    return max;
+  return speed;
 }
 
-void precalcFanSpeeds(void) {
-  const unsigned int TempTargets[] = {55, 80};
-  const unsigned int FanTargets[] = {40, 100};
-  const unsigned int CountTargets = sizeof(FanTargets) / sizeof(FanTargets[0]);
-  // Compile time sanity checks. These are here to protect you
-  _Static_assert(sizeof(TempTargets) / sizeof(TempTargets[0]) ==
-                     sizeof(FanTargets) / sizeof(FanTargets[0]),
-                 "TempTargets and FanTargets must have the same length");
-  runTimeSanity(TempTargets, FanTargets, CountTargets);
+/* Clamps a curve table into what the card allows. A curve reaching 0 asks
+ * for zero RPM: the fan starts where the rising table first leaves 0 and
+ * only stops again ZERO_RPM_STOP_DELTA degrees below that, or at MIN_TEMP
+ * when the curve is too short for the full delta. Everywhere else
+ * the fan is kept within minSpeed and maxSpeed. */
+static void precalcFanTable(const FanTable *curve, FanTable *table,
+                            const unsigned int minSpeed,
+                            const unsigned int maxSpeed) {
+  unsigned int start = 0;
+  while (start < TEMP_STEPS && curve->up[start] == 0)
+    start++;
+  // Outside the stop band the fan keeps the curve's lowest running speed
+  unsigned int running = start < TEMP_STEPS ? curve->up[start] : 0;
+  for (unsigned int i = 0; i < TEMP_STEPS; i++) {
+    if (curve->down[i]) {
+      running = curve->down[i];
+      break;
+    }
+  }
 
-  unsigned int slopes[CountTargets - 1];
-  for (unsigned int i = 0; i < CountTargets - 1; i++) {
-    slopes[i] = (FanTargets[i + 1] - FanTargets[i]) * 100 /
-                (TempTargets[i + 1] - TempTargets[i]);
+  for (unsigned int i = 0; i < TEMP_STEPS; i++) {
+    table->up[i] =
+        i < start ? 0 : clampFanSpeed(curve->up[i], minSpeed, maxSpeed);
+    const int stop = i == 0 || i + ZERO_RPM_STOP_DELTA <= start;
+    if (stop && curve->down[i] == 0)
+      table->down[i] = 0;
+    else
+      table->down[i] = clampFanSpeed(curve->down[i] ? curve->down[i] : running,
+                                     minSpeed, maxSpeed);
   }
+}
 
-  for (int i = MIN_TEMP; i <= MAX_TEMP; i++) {
-    FanSpeeds[i - MIN_TEMP] =
-        fanspeedFromT(i, slopes, TempTargets, FanTargets, CountTargets);
+static const FanTable *fanCurveTable(const unsigned int fan) {
+  for (unsigned int i = 0; FanCurveFans[i] >= 0; i++) {
+    if (FanCurveFans[i] == (int)fan)
+      return &FanSpeeds[i + 1];
   }
+  return &FanSpeeds[0];
 }
 
-unsigned int getFanSpeed(unsigned int temperature) {
+static unsigned int tempIndex(const unsigned int temperature) {
   if (temperature < MIN_TEMP)
-    temperature = MIN_TEMP;
+    return 0;
   if (temperature > MAX_TEMP)
-    temperature = MAX_TEMP;
-  return FanSpeeds[temperature - MIN_TEMP];
+    return MAX_TEMP - MIN_TEMP;
+  return temperature - MIN_TEMP;
 }
 
-static void nvmlStart() {
-  nvmlReturn_t result;
+/* Applies the hysteresis band to the current target speed. */
+static unsigned int getFanSpeed(const Fan *fan, const unsigned int i) {
+  const unsigned int current = fan->targetFanSpeed;
+  if (fan->table.up[i] > current)
+    return fan->table.up[i];
+  if (fan->table.down[i] < current)
+    return fan->table.down[i];
+  return current;
+}
 
-  result = nvmlInit_v2();
-  if (result != NVML_SUCCESS) {
-    DEBUG_PRINT("Failed to initialize NVML: %s\n", nvmlErrorString(result));
-    cleanup(EXIT_FAILURE);
-  }
+/* Lets the kernel defer this thread's timers by up to TIMER_SLACK_NS, so
+ * they expire together with other wakeups. */
+static void setTimerSlack(void) {
+  if (lowPower && prctl(PR_SET_TIMERSLACK, TIMER_SLACK_NS) != 0)
+    DEBUG_PRINT("Failed to set timer slack\n");
+}
 
-  result = nvmlDeviceGetCount_v2(&deviceCount);
-  if (result != NVML_SUCCESS) {
-    DEBUG_PRINT("Failed to get device count: %s\n", nvmlErrorString(result));
-    cleanup(EXIT_FAILURE);
-  } else if (deviceCount < 1) {
-    DEBUG_PRINT("Unsupported: No Nvidia Devices found.\n");
-    cleanup(EXIT_FAILURE);
+/* Rounds a deadline up to the next multiple of WAKEUP_GRID_MS in low power
+ * mode. */
+static unsigned long long onWakeupGrid(const unsigned long long deadline) {
+  if (!lowPower)
+    return deadline;
+  return (deadline + WAKEUP_GRID_MS - 1) / WAKEUP_GRID_MS * WAKEUP_GRID_MS;
+}
+
+static void countWakeup(const unsigned long long instant) {
+  atomic_fetch_add_explicit(&wakeups, 1, memory_order_relaxed);
+  if (atomic_exchange_explicit(&lastWakeInstant, instant,
+                               memory_order_relaxed) != instant)
+    atomic_fetch_add_explicit(&wakeupInstants, 1, memory_order_relaxed);
+}
+
+static void sleepUntilMs(unsigned long long deadline) {
+  deadline = onWakeupGrid(deadline);
+  struct timespec ts = {.tv_sec = deadline / 1000,
+                        .tv_nsec = (deadline % 1000) * 1000000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 &&
+         !terminate && !rescanRequested) {
+    continue;
   }
+  countWakeup(deadline);
 }
 
-void *deviceLoop(void *arg) {
-  Device *device = (Device *)arg;
+/* Zero RPM on a card that cannot be set below its minimum is left to the
+ * firmware, which stops the fans itself while idle. */
+static void setFanSpeed(Device *device, const unsigned int fan,
+                        const unsigned int fanSpeed) {
   nvmlReturn_t result;
-  unsigned int temperature;
-  const unsigned int polling_interval = 1000000;
-
-  result = nvmlDeviceGetHandleByIndex_v2(device->id, &device->handle);
+  if (fanSpeed == 0 && device->minFanSpeed > 0)
+    result = nvml.DeviceSetDefaultFanSpeed(device->handle, fan);
+  else
+    result = nvml.DeviceSetFanSpeed(device->handle, fan, fanSpeed);
   if (result != NVML_SUCCESS) {
-    DEBUG_PRINT("Failed to get device %d handle: %s\n", device->id,
-                nvmlErrorString(result));
-    cleanup(EXIT_FAILURE);
+    DEBUG_PRINT("Failed to set fan: %d to speed:%d for device:%d: %s\n", fan,
+                fanSpeed, device->id, nvml.ErrorString(result));
   }
+  device->fans[fan].changedAt = monotonicMs();
+}
 
-  result = nvmlDeviceGetNumFans(device->handle, &device->fanCount);
-  if (result != NVML_SUCCESS) {
-    DEBUG_PRINT("Failed to get fan count for device %d: %s\n", device->id,
-                nvmlErrorString(result));
-    cleanup(EXIT_FAILURE);
+/* Starts a capture: the device polls every FLIGHT_FAST_MS for FLIGHT_POST_MS
+ * and then hands the capture to the main thread. Triggers during a capture,
+ * the holdoff after it or before it was dumped are ignored. */
+static void triggerFlight(Device *device, const FlightReason reason,
+                          const unsigned long long now) {
+  if (!device->flightMode || device->flightUntil ||
+      now < device->flightHoldoff ||
+      atomic_load_explicit(&device->flightReady, memory_order_acquire))
+    return;
+  DEBUG_PRINT("Device %d flight recorder triggered by %s\n", device->id,
+              FlightReasonNames[reason]);
+  device->flightReason = reason;
+  device->flightAt = now;
+  device->flightTrigger = atomic_load_explicit(&device->flightHead,
+                                               memory_order_relaxed);
+  device->flightUntil = now + FLIGHT_POST_MS;
+  device->flightTriggers[reason]++;
+}
+
+/* Ends the capture and hands it to the main thread to dump. */
+static void finishFlight(Device *device, const unsigned long long now) {
+  device->flightEnd =
+      atomic_load_explicit(&device->flightHead, memory_order_relaxed);
+  device->flightUntil = 0;
+  device->flightHoldoff = now + FLIGHT_HOLDOFF_MS;
+  atomic_store_explicit(&device->flightReady, 1, memory_order_release);
+}
+
+/* Keeps the tick in the flight recorder's ring, overwriting the oldest, and
+ * watches the temperature for a fast rise against a baseline renewed every
+ * FLIGHT_SLOPE_MS. */
+static void recordFlight(Device *device, const unsigned long long now,
+                         const unsigned int temperature,
+                         const unsigned int controlTemp,
+                         const unsigned int fan, const unsigned int boost,
+                         const int ramping) {
+  const unsigned int head =
+      atomic_load_explicit(&device->flightHead, memory_order_relaxed);
+  FlightSample *sample = &device->flight[head % FLIGHT_RING];
+  sample->ms = now;
+  sample->temperature = temperature < 255 ? temperature : 255;
+  sample->controlTemp = controlTemp < 255 ? controlTemp : 255;
+  sample->fan = fan;
+  sample->boost = boost < 100 ? boost : 100;
+  sample->flags = (device->throttledSince ? FLIGHT_SLOWDOWN : 0) |
+                  (ramping ? FLIGHT_RAMPING : 0);
+  atomic_store_explicit(&device->flightHead, head + 1, memory_order_release);
+
+  if (temperature < device->flightBase ||
+      now - device->flightBaseAt >= FLIGHT_SLOPE_MS) {
+    device->flightBase = temperature;
+    device->flightBaseAt = now;
+  } else if (temperature >= device->flightBase + FLIGHT_SLOPE_C) {
+    triggerFlight(device, FLIGHT_SLOPE, now);
   }
+  if (device->flightUntil && now >= device->flightUntil)
+    finishFlight(device, now);
+}
 
-  /* LOOP */
-  while (!terminate) {
-    result = nvmlDeviceGetTemperature(device->handle, NVML_TEMPERATURE_GPU,
-                                      &temperature);
+/* Reads every fan of the device back in one pass and compares it with the
+ * commanded speed. Fans that are still ramping, settling or stopped are not
+ * judged. Counts the stalled fans for deviceTick() to fall back on the
+ * others. */
+static void checkFans(Device *device, const unsigned long long now) {
+  unsigned int stalled = 0;
+  for (unsigned int i = 0; i < device->fanCount; i++) {
+    Fan *fan = &device->fans[i];
+    unsigned int actual;
+    nvmlReturn_t result = nvml.DeviceGetFanSpeed(device->handle, i, &actual);
     if (result != NVML_SUCCESS) {
-      DEBUG_PRINT("Failed to get temperature for device %d: %s\n", device->id,
-                  nvmlErrorString(result));
+      DEBUG_PRINT("Failed to read fan: %d for device:%d: %s\n", i, device->id,
+                  nvml.ErrorString(result));
       continue;
     }
+    fan->actualFanSpeed = actual;
 
-    unsigned int temp_diff = device->prevTemperature > temperature
-                                 ? device->prevTemperature - temperature
-                                 : temperature - device->prevTemperature;
-    if (temp_diff >= TEMP_THRESHOLD) {
-
-      unsigned int fanSpeed = getFanSpeed(temperature);
-      if (device->prevFanSpeed != fanSpeed) {
-        for (unsigned int i = 0; i < device->fanCount; i++) {
-          result = nvmlDeviceSetFanSpeed_v2(device->handle, i, fanSpeed);
-          if (result != NVML_SUCCESS) {
-            DEBUG_PRINT("Failed to set fan: %d to speed:%d for device:%d: %s\n",
-                        i, fanSpeed, device->id, nvmlErrorString(result));
-          }
-        }
+    const unsigned int commanded = fan->prevFanSpeed;
+    if (commanded == 0 || commanded != fan->targetFanSpeed ||
+        now - fan->changedAt < FAN_SETTLE_MS)
+      continue;
 
-        DEBUG_PRINT("Monitoring device: %d temp: %d->%d fans:%d@%d->%d\n",
-                    device->id, device->prevTemperature, temperature,
-                    device->fanCount, device->prevFanSpeed, fanSpeed);
+    const unsigned int error =
+        commanded > actual ? commanded - actual : actual - commanded;
+    fan->errorAvg16 = (fan->errorAvg16 * 7 + error * 16) / 8;
+    fan->checks++;
+    fan->zeroChecks = actual == 0 ? fan->zeroChecks + 1 : 0;
 
-        device->prevTemperature = temperature;
-        device->prevFanSpeed = fanSpeed;
-      }
+    FanHealth health = FAN_OK;
+    if (fan->zeroChecks >= FAN_STALL_CHECKS) {
+      health = FAN_STALLED;
+      if (fan->health != FAN_STALLED)
+        fan->stallCount++;
+    } else if (fan->errorAvg16 > FAN_DEGRADED_PCT * 16) {
+      health = FAN_DEGRADED;
+      if (fan->health != FAN_DEGRADED)
+        fan->degradedCount++;
+    } else if (error > FAN_LAG_PCT) {
+      health = FAN_LAG;
+      fan->lagCount++;
+    }
+    if (health != fan->health) {
+      DEBUG_PRINT("Device: %d fan:%d commanded:%d actual:%d is %s\n",
+                  device->id, i, commanded, actual, FanHealthNames[health]);
+      if (health >= FAN_DEGRADED)
+        triggerFlight(device, FLIGHT_FAN, now);
     }
-    usleep((temp_diff > 5) ? polling_interval / 2 : polling_interval);
+    fan->health = health;
   }
-  /* End LOOP */
+  for (unsigned int i = 0; i < device->fanCount; i++)
+    stalled += device->fans[i].health == FAN_STALLED;
+  device->stalledFans = stalled;
+}
 
-  /* Terminate signaled reset fan control to firmware */
-  for (unsigned int i = 0; i < device->fanCount; i++) {
-    result = nvmlDeviceSetDefaultFanSpeed_v2(device->handle, i);
-    if (result != NVML_SUCCESS) {
-      DEBUG_PRINT(
-          "Failed to set fan: %d to firmware default for device:%d: %s\n", i,
-          device->id, nvmlErrorString(result));
+/* Moves a fan one ramp step towards its target. Speeding up is never
+ * delayed; slowing down waits out the hold time of the last change. Starting
+ * and stopping are not ramped. Returns 1 while further steps are pending. */
+static int rampFanSpeed(Device *device, const unsigned int i,
+                        const unsigned long long now) {
+  Fan *fan = &device->fans[i];
+  const unsigned int current = fan->prevFanSpeed;
+  const unsigned int target = fan->targetFanSpeed;
+
+  if (current == target)
+    return 0;
+  if (target < current && now < fan->holdUntil)
+    return 0;
+
+  unsigned int next = target;
+  // first command after start is applied as is
+  if (fan->holdUntil != 0 && current != 0 && target != 0) {
+    const unsigned int rate =
+        target > current ? device->rampUpRate : device->rampDownRate;
+    unsigned int step = rate * RAMP_STEP_MS / 1000;
+    if (step == 0)
+      step = 1;
+    if (target > current)
+      next = target - current > step ? current + step : target;
+    else
+      next = current - target > step ? current - step : target;
+  }
+
+  setFanSpeed(device, i, next);
+  DEBUG_PRINT("Ramping device: %d fan:%d@%d->%d target:%d\n", device->id, i,
+              current, next, target);
+  fan->prevFanSpeed = next;
+  if (next == target)
+    fan->holdUntil = now + device->minHoldMs;
+  return next != target;
+}
+
+static int findSlot(const char *busId) {
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) == SLOT_ACTIVE &&
+        strcasecmp(registry[i].busId, busId) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Resolves Neighbours against the registry. Reruns whenever a device was
+ * adopted or retired, a retired slot reads as cold until then. */
+static void findNeighbours(Device *device) {
+  device->neighbourGeneration = atomic_load(&registryGeneration);
+  device->neighbourCount = 0;
+  for (const Adjacency *a = Neighbours; a->busId; a++) {
+    if (strcasecmp(a->busId, device->busId) != 0)
+      continue;
+    const int neighbour = findSlot(a->neighbourBusId);
+    if (neighbour < 0 || &registry[neighbour] == device)
+      continue;
+    if (device->neighbourCount == MAX_NEIGHBOURS) {
+      DEBUG_PRINT("Device %d has more than %d neighbours\n", device->id,
+                  MAX_NEIGHBOURS);
+      break;
     }
+    device->neighbours[device->neighbourCount++] = neighbour;
   }
+}
 
-  DEBUG_PRINT("Device %d thread terminated\n", device->id);
-  free(device);
-  return NULL;
+/* Folds the neighbours' last published state into this device's decision.
+ * Their temperature, less COUPLING_OFFSET, counts as if it were our own and
+ * COUPLING_SHARE of their fan speed becomes a floor for ours. */
+static void coupleNeighbours(const Device *device, unsigned int *temperature,
+                             unsigned int *floor) {
+  *floor = 0;
+  for (unsigned int n = 0; n < device->neighbourCount; n++) {
+    const unsigned int state = atomic_load_explicit(
+        &registry[device->neighbours[n]].snapshot, memory_order_relaxed);
+    const unsigned int temp = state >> 16;
+    const unsigned int share = (state & 0xffff) * COUPLING_SHARE / 100;
+    if (temp > COUPLING_OFFSET && temp - COUPLING_OFFSET > *temperature)
+      *temperature = temp - COUPLING_OFFSET;
+    if (share > *floor)
+      *floor = share;
+  }
 }
 
-void threadDevices() {
-  threads = malloc(sizeof(pthread_t) * deviceCount);
-  if (!threads) {
-    DEBUG_PRINT("Failed to allocate threads array\n");
-    cleanup(EXIT_FAILURE);
+/* Loads NVML_LIBRARY and fills the nvml table. A library that cannot be
+ * opened or lacks a symbol is unloaded again, e.g. mid driver upgrade. */
+static int loadNvml(void) {
+  if (nvml.library)
+    return 1;
+
+  void *library = dlopen(NVML_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    DEBUG_PRINT("Failed to load %s: %s\n", NVML_LIBRARY, dlerror());
+    return 0;
   }
 
-  for (unsigned int i = 0; i < deviceCount; i++) {
-    Device *device = malloc(sizeof(Device));
-    if (!device) {
-      DEBUG_PRINT("Failed to allocate device index\n");
-      cleanup(EXIT_FAILURE);
+  for (unsigned int i = 0; i < COUNT_OF(NvmlSymbols); i++) {
+    const NvmlSymbol *symbol = &NvmlSymbols[i];
+    void *entry = NULL;
+    for (unsigned int n = 0; n < COUNT_OF(symbol->names) && symbol->names[n];
+         n++) {
+      entry = dlsym(library, symbol->names[n]);
+      if (entry)
+        break;
+    }
+    if (!entry && !symbol->optional) {
+      DEBUG_PRINT("%s lacks %s\n", NVML_LIBRARY, symbol->names[0]);
+      dlclose(library);
+      memset(&nvml, 0, sizeof(nvml));
+      return 0;
+    }
+    *symbol->entry = entry;
+  }
+  nvml.library = library;
+  return 1;
+}
+
+/* Waits up to NVML_LOAD_TIMEOUT_MS for the driver, so a service started
+ * during a driver upgrade does not crash loop through systemd. */
+static void nvmlStart() {
+  const unsigned long long deadline = monotonicMs() + NVML_LOAD_TIMEOUT_MS;
+
+  while (!terminate) {
+    if (loadNvml()) {
+      nvmlReturn_t result = nvml.Init();
+      if (result == NVML_SUCCESS)
+        return;
+      DEBUG_PRINT("Failed to initialize NVML: %s\n", nvml.ErrorString(result));
     }
+    if (monotonicMs() >= deadline)
+      break;
+    sleepUntilMs(monotonicMs() + NVML_LOAD_RETRY_MS);
+  }
+  cleanup(EXIT_FAILURE);
+}
+
+/* Parses a CPU list such as "0-3,8". */
+static void parseCpuList(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*list) {
+    char *end;
+    unsigned long first = strtoul(list, &end, 10);
+    unsigned long last = first;
+    if (end == list)
+      break;
+    if (*end == '-')
+      last = strtoul(end + 1, &end, 10);
+    for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, set);
+    list = *end == ',' ? end + 1 : end;
+  }
+}
+
+static void pinThread(const cpu_set_t *set) {
+  if (CPU_COUNT(set) == 0)
+    return;
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set) != 0)
+    DEBUG_PRINT("Failed to set CPU affinity\n");
+}
+
+static void moveToNode(void *addr, const size_t length,
+                       const unsigned int node) {
+  const uintptr_t page = PAGE_SIZE_HINT - 1;
+  const uintptr_t start = (uintptr_t)addr & ~page;
+  const uintptr_t end = ((uintptr_t)addr + length + page) & ~page;
+  unsigned long nodemask[4] = {0};
+  if (node >= sizeof(nodemask) * 8)
+    return;
+  nodemask[node / (sizeof(long) * 8)] = 1UL << (node % (sizeof(long) * 8));
+  if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodemask,
+              sizeof(nodemask) * 8, MPOL_MF_MOVE) != 0)
+    DEBUG_PRINT("Failed to move memory to node %u\n", node);
+}
+
+/* Pins the calling device thread according to its placement. GPU local
+ * placement uses the CPUs NVML reports as close to the GPU, narrowed to
+ * HOUSEKEEPING_CPUS where they overlap, and moves the Device and the
+ * thread's stack to the GPU's NUMA node. */
+static void placeDeviceThread(Device *device) {
+  cpu_set_t housekeeping;
+  parseCpuList(HOUSEKEEPING_CPUS, &housekeeping);
+  if (device->placement == 1) {
+    pinThread(&housekeeping);
+    return;
+  }
+  if (device->placement != 2 || !nvml.DeviceGetCpuAffinity)
+    return;
+
+  unsigned long mask[CPU_SETSIZE / (sizeof(unsigned long) * 8)] = {0};
+  nvmlReturn_t result =
+      nvml.DeviceGetCpuAffinity(device->handle, COUNT_OF(mask), mask);
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to get CPU affinity for device %d: %s\n", device->id,
+                nvml.ErrorString(result));
+    return;
+  }
+  cpu_set_t local, both;
+  CPU_ZERO(&local);
+  for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (mask[cpu / (sizeof(unsigned long) * 8)] &
+        (1UL << (cpu % (sizeof(unsigned long) * 8))))
+      CPU_SET(cpu, &local);
+  }
+  CPU_AND(&both, &local, &housekeeping);
+  pinThread(CPU_COUNT(&both) ? &both : &local);
+
+  unsigned int node;
+  if (!nvml.DeviceGetNumaNodeId ||
+      nvml.DeviceGetNumaNodeId(device->handle, &node) != NVML_SUCCESS)
+    return;
+  moveToNode(&device->id, sizeof(Device) - offsetof(Device, id), node);
+  pthread_attr_t attr;
+  void *stack;
+  size_t stackSize;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    if (pthread_attr_getstack(&attr, &stack, &stackSize) == 0)
+      moveToNode(stack, stackSize, node);
+    pthread_attr_destroy(&attr);
+  }
+  DEBUG_PRINT("Device %d placed on NUMA node %u\n", device->id, node);
+}
 
-    device->id = i;
-    device->prevFanSpeed = 1; // 1 avoids gate overlap with 0 RPM
-    device->prevTemperature = 0;
+/* Clock event reasons are read every tick only for the features that use
+ * them: the throttle boost, performance mode and the flight recorder. */
+static int watchesThrottle(const Device *device) {
+  return device->throttleStep || device->perfMode || device->flightMode;
+}
 
-    if (pthread_create(&threads[i], NULL, deviceLoop, device) != 0) {
-      DEBUG_PRINT("Failed to create thread for device %d\n", i);
-      free(device);
-      cleanup(EXIT_FAILURE);
+/* Thermal slowdown means the curve is not keeping up. Every tick it lasts
+ * adds the device's throttle step to all fans on top of the curve. Once the
+ * reason clears, one step is taken off for every THROTTLE_HOLD_MS without
+ * slowdown, so the boost settles near what the GPU needs instead of
+ * dropping to the curve that throttled it. The time throttled is counted
+ * with or without a step. */
+static void updateThrottle(Device *device, const unsigned long long reasons,
+                           const unsigned long long now) {
+  if (reasons & THERMAL_SLOWDOWN) {
+    if (!device->throttledSince) {
+      DEBUG_PRINT("Device %d thermal slowdown 0x%llx\n", device->id, reasons);
+      device->throttledSince = now;
+      device->throttleEvents++;
+      triggerFlight(device, FLIGHT_THROTTLE, now);
     }
+    if (device->throttleBoost < 100)
+      device->throttleBoost += device->throttleStep;
+  } else if (device->throttledSince) {
+    DEBUG_PRINT("Device %d thermal slowdown cleared after %llums\n",
+                device->id, now - device->throttledSince);
+    device->throttledMs += now - device->throttledSince;
+    device->throttledSince = 0;
+    device->throttleHeldAt = now;
+  } else if (device->throttleBoost &&
+             now - device->throttleHeldAt >= THROTTLE_HOLD_MS) {
+    device->throttleBoost -= device->throttleBoost < device->throttleStep
+                                 ? device->throttleBoost
+                                 : device->throttleStep;
+    device->throttleHeldAt = now;
   }
 }
 
-int main(void) {
-  signal(SIGINT, signal_handler);
-  signal(SIGTERM, signal_handler);
+/* Records the SM clock seen under load at this temperature. A boost step is
+ * the first temperature whose highest clock is at least PERF_BIN_MHZ below
+ * the next cooler temperature seen, once both have PERF_SAMPLES readings. */
+static void learnBoostSteps(Device *device, const unsigned int temperature,
+                            const unsigned int clock) {
+  if (temperature < PERF_MIN_TEMP || temperature > PERF_MAX_TEMP)
+    return;
+  const unsigned int i = temperature - PERF_MIN_TEMP;
+  int changed = 0;
+  if (device->perfSamples[i] < PERF_SAMPLES)
+    changed = ++device->perfSamples[i] == PERF_SAMPLES;
+  if (clock > device->perfClock[i]) {
+    device->perfClock[i] = clock;
+    changed |= device->perfSamples[i] == PERF_SAMPLES;
+  }
+  if (!changed)
+    return;
 
-  precalcFanSpeeds();
-  nvmlStart();
-  threadDevices();
+  unsigned long long steps = 0;
+  unsigned int prevClock = 0;
+  for (unsigned int t = 0; t < PERF_TEMPS; t++) {
+    if (device->perfSamples[t] < PERF_SAMPLES)
+      continue;
+    // Widened first, a short would promote to int against unsigned prevClock
+    const unsigned int highest = device->perfClock[t];
+    if (prevClock >= highest + PERF_BIN_MHZ)
+      steps |= 1ULL << t;
+    prevClock = highest;
+  }
+  if (steps != device->perfSteps)
+    DEBUG_PRINT("Device %d boost steps 0x%llx\n", device->id, steps);
+  device->perfSteps = steps;
+}
 
-  while (!terminate) {
-    pause();
+/* Holds the GPU PERF_MARGIN below the next boost step, or wins back one it
+ * crossed by less than PERF_RECLAIM, by adding fan a little every tick and
+ * taking it away again once the GPU is PERF_DEADBAND below the target, so
+ * the boost holds still around it. At most PERF_MAX_BOOST is spent on this,
+ * so a step that costs more is given up for the next one. Idle GPUs get no
+ * boost. */
+static void updatePerfBoost(Device *device, const unsigned int temperature,
+                            const int loaded) {
+  unsigned int target = 0;
+  if (loaded) {
+    // Steps above temperature - PERF_RECLAIM
+    const int from = (int)temperature + 1 - PERF_RECLAIM - PERF_MIN_TEMP;
+    unsigned long long above = device->perfSteps;
+    if (from >= PERF_TEMPS)
+      above = 0;
+    else if (from > 0)
+      above = above >> from << from;
+    if (above)
+      target = PERF_MIN_TEMP + __builtin_ctzll(above) - PERF_MARGIN;
+  }
+
+  if (target && temperature > target && device->perfBoost < PERF_MAX_BOOST)
+    device->perfBoost += PERF_BOOST_STEP;
+  else if ((!target || temperature + PERF_DEADBAND < target) &&
+           device->perfBoost)
+    device->perfBoost -= device->perfBoost < PERF_BOOST_STEP
+                             ? device->perfBoost
+                             : PERF_BOOST_STEP;
+}
+
+/* Power capping needs the limit as found, to restore it, and the lowest the
+ * card accepts. A handoff passes on the limit from before any capping. */
+static void initPowerCap(Device *device) {
+  unsigned int limit, min, max;
+  if (!nvml.DeviceGetPowerManagementLimit ||
+      !nvml.DeviceGetPowerManagementLimitConstraints ||
+      !nvml.DeviceSetPowerManagementLimit ||
+      nvml.DeviceGetPowerManagementLimit(device->handle, &limit) !=
+          NVML_SUCCESS ||
+      nvml.DeviceGetPowerManagementLimitConstraints(device->handle, &min,
+                                                    &max) != NVML_SUCCESS) {
+    DEBUG_PRINT("Device %d has no settable power limit\n", device->id);
+    return;
+  }
+  device->powerLimit = limit;
+  device->powerLimitMin = min;
+  device->powerLimitOrig = limit;
+  if (device->handoff && device->handoff->powerLimit)
+    device->powerLimitOrig = device->handoff->powerLimit;
+}
+
+/* Once the fans are at their maximum and the GPU still runs above
+ * POWER_CAP_TEMP, the power limit is lowered by POWER_CAP_STEP percent of the
+ * original every POWER_CAP_INTERVAL_MS, but never below what the card allows.
+ * It is raised the same way once the GPU is POWER_CAP_RELEASE degrees cooler.
+ * A gradual cap keeps clocks steadier than the firmware's thermal slowdown,
+ * which cuts them in half. */
+static void updatePowerCap(Device *device, const unsigned int temperature,
+                           const int pegged, const unsigned long long now) {
+  if (now - device->powerCapAt < POWER_CAP_INTERVAL_MS)
+    return;
+  const unsigned int step = device->powerLimitOrig / 100 * POWER_CAP_STEP;
+  unsigned int limit = device->powerLimit;
+  if (pegged && temperature > POWER_CAP_TEMP)
+    limit = limit > device->powerLimitMin + step ? limit - step
+                                                 : device->powerLimitMin;
+  else if (temperature < POWER_CAP_TEMP - POWER_CAP_RELEASE)
+    limit = limit + step < device->powerLimitOrig ? limit + step
+                                                  : device->powerLimitOrig;
+  if (limit == device->powerLimit)
+    return;
+
+  device->powerCapAt = now;
+  nvmlReturn_t result = nvml.DeviceSetPowerManagementLimit(device->handle,
+                                                           limit);
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to set power limit %umW for device %d: %s\n", limit,
+                device->id, nvml.ErrorString(result));
+    return;
+  }
+  DEBUG_PRINT("Device %d power limit %u->%umW at %uC\n", device->id,
+              device->powerLimit, limit, temperature);
+  device->powerLimit = limit;
+}
+
+static const ProcessProfile DefaultProfile = {NULL, PRECOOL_BOOST, PRECOOL_MS};
+
+static const ProcessProfile *processProfile(const unsigned int pid) {
+  char path[256];
+  if (!ProcessProfiles[0].name || !nvml.SystemGetProcessName ||
+      nvml.SystemGetProcessName(pid, path, sizeof(path)) != NVML_SUCCESS)
+    return &DefaultProfile;
+  const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  for (const ProcessProfile *p = ProcessProfiles; p->name; p++) {
+    if (strcmp(p->name, name) == 0)
+      return p;
+  }
+  return &DefaultProfile;
+}
+
+static void precool(Device *device, const ProcessProfile *profile,
+                    const unsigned long long now) {
+  device->precoolEvents++;
+  if (profile->boost > device->precoolBoost)
+    device->precoolBoost = profile->boost;
+  if (now + profile->ms > device->precoolUntil)
+    device->precoolUntil = now + profile->ms;
+}
+
+/* A compute process that was not running at the last look is about to load
+ * the GPU, well before its temperature shows it. The fans are boosted right
+ * away by its profile, and the curve takes over once the boost runs out.
+ * With more than MAX_PROCESSES NVML returns none of them, so a rise in their
+ * number counts as one unknown process starting. */
+static void watchProcesses(Device *device, const unsigned long long now) {
+  nvmlProcessInfo_t infos[MAX_PROCESSES];
+  unsigned int count = MAX_PROCESSES;
+  nvmlReturn_t result =
+      nvml.DeviceGetComputeRunningProcesses(device->handle, &count, infos);
+  if (result == NVML_ERROR_INSUFFICIENT_SIZE) {
+    if (!device->processOverflow) {
+      DEBUG_PRINT("Device %d has %u compute processes, only their number is "
+                  "watched above %d\n",
+                  device->id, count, MAX_PROCESSES);
+      device->processOverflow = 1;
+    }
+    if (device->pidsKnown && count > device->processCount)
+      precool(device, &DefaultProfile, now);
+    device->processCount = count;
+    device->pidCount = 0;
+    device->pidsKnown = 1;
+    return;
+  }
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to get processes for device %d: %s\n", device->id,
+                nvml.ErrorString(result));
+    return;
+  }
+
+  // Back from more than MAX_PROCESSES the list only sets the baseline
+  const int compare =
+      device->pidsKnown && device->processCount <= MAX_PROCESSES;
+  for (unsigned int i = 0; i < count && compare; i++) {
+    unsigned int j = 0;
+    while (j < device->pidCount && device->pids[j] != infos[i].pid)
+      j++;
+    if (j < device->pidCount)
+      continue;
+    const ProcessProfile *profile = processProfile(infos[i].pid);
+    if (!profile->boost)
+      continue;
+    DEBUG_PRINT("Device %d process %u started, pre-cooling %u%% for %ums\n",
+                device->id, infos[i].pid, profile->boost, profile->ms);
+    precool(device, profile, now);
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+    device->pids[i] = infos[i].pid;
+  device->pidCount = count;
+  device->processCount = count;
+  device->pidsKnown = 1;
+}
+
+/* A hint lasts from HINT_LEAD_MS before the load is expected until it ends,
+ * and adds fan in proportion to the hinted power. */
+static unsigned int hintBoost(const Device *device,
+                              const unsigned long long now) {
+  const unsigned int watts =
+      atomic_load_explicit(&device->hintWatts, memory_order_acquire);
+  if (!watts ||
+      now + HINT_LEAD_MS <
+          atomic_load_explicit(&device->hintStart, memory_order_relaxed) ||
+      now >= atomic_load_explicit(&device->hintEnd, memory_order_relaxed))
+    return 0;
+  const unsigned int rated =
+      device->powerRated ? device->powerRated : HINT_RATED_W * 1000;
+  const unsigned long long boost =
+      (unsigned long long)HINT_BOOST * watts * 1000 / rated;
+  return boost < 100 ? boost : 100;
+}
+
+/* A model to start from: a typical card with its cooler at 30 C intake. */
+static void initModel(ThermalModel *m) {
+  const double capacity = 250, conductance = 4, fanGain = 6, ambient = 30;
+  memset(m, 0, sizeof(*m));
+  m->theta[0] = MODEL_SCALE / capacity;
+  m->theta[1] = MODEL_SCALE * conductance / capacity;
+  m->theta[2] = MODEL_SCALE * fanGain / capacity;
+  m->theta[3] = conductance * ambient / capacity;
+  for (unsigned int i = 0; i < MODEL_PARAMS; i++)
+    m->cov[i][i] = MODEL_PRIOR_COV;
+  m->noise = 0.01;
+}
+
+/* One recursive least squares step towards the rate y seen for the mean
+ * regressors x. Older steps are forgotten by MODEL_FORGET, except while
+ * the covariance is as wide as the prior: with nothing changing the fit
+ * keeps what it has rather than winding up. */
+static void updateModel(ThermalModel *m, const double *x, const double y) {
+  double px[MODEL_PARAMS], denom = 0, trace = 0, error = y;
+  for (unsigned int i = 0; i < MODEL_PARAMS; i++) {
+    px[i] = 0;
+    for (unsigned int j = 0; j < MODEL_PARAMS; j++)
+      px[i] += m->cov[i][j] * x[j];
+    denom += x[i] * px[i];
+    trace += m->cov[i][i];
+    error -= m->theta[i] * x[i];
+  }
+  const double forget =
+      trace < MODEL_PARAMS * MODEL_PRIOR_COV ? MODEL_FORGET : 1.0;
+  denom += forget;
+  for (unsigned int i = 0; i < MODEL_PARAMS; i++) {
+    m->theta[i] += px[i] / denom * error;
+    for (unsigned int j = 0; j < MODEL_PARAMS; j++)
+      m->cov[i][j] = (m->cov[i][j] - px[i] * px[j] / denom) / forget;
+  }
+  m->noise = m->noise * MODEL_FORGET + (1 - MODEL_FORGET) * error * error;
+  m->updates++;
+}
+
+/* Integrates the regressors between ticks and fits a step of the model
+ * every MODEL_INTERVAL_MS, from the temperature change over it. Steps
+ * that long average out the whole degree readings while staying well
+ * within a cooler's time constant. */
+static void trackModel(Device *device, const unsigned long long now,
+                       const unsigned int temperature, const unsigned int fan,
+                       const unsigned int power) {
+  if (device->modelStart) {
+    const double dt = (now - device->modelAt) / 1000.0;
+    for (unsigned int i = 0; i < MODEL_PARAMS; i++)
+      device->modelSums[i] += device->modelX[i] * dt;
+  } else {
+    device->modelStart = now;
+    device->modelTemp = temperature;
+    memset(device->modelSums, 0, sizeof(device->modelSums));
+  }
+  device->modelAt = now;
+  const double f = fan / 100.0, t = temperature;
+  device->modelX[0] = power / 1000.0 / MODEL_SCALE;
+  device->modelX[1] = -t / MODEL_SCALE;
+  const double *theta = device->model.theta;
+  const double ambient =
+      theta[1] > 0 ? MODEL_SCALE * theta[3] / theta[1] : t; // Ta of the fit
+  device->modelX[2] = -f * (t - ambient) / MODEL_SCALE;
+  device->modelX[3] = 1;
+
+  if (now - device->modelStart < MODEL_INTERVAL_MS)
+    return;
+  const double span = (now - device->modelStart) / 1000.0;
+  double mean[MODEL_PARAMS];
+  for (unsigned int i = 0; i < MODEL_PARAMS; i++)
+    mean[i] = device->modelSums[i] / span;
+  const double rate = ((double)temperature - device->modelTemp) / span;
+  atomic_fetch_add_explicit(&device->modelSeq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  updateModel(&device->model, mean, rate);
+  atomic_fetch_add_explicit(&device->modelSeq, 1, memory_order_release);
+  device->modelStart = now;
+  device->modelTemp = temperature;
+  memset(device->modelSums, 0, sizeof(device->modelSums));
+}
+
+/* Rebuilds the planning tables from the model, or leaves them empty until
+ * it has seen MPC_MIN_UPDATES steps and every parameter is known to within
+ * MPC_MAX_UNCERTAINTY. Over one step at fan speed f the temperature decays
+ * towards Ta + P / (G0 + G1 f) by exp(-step (G0 + G1 f) / C). */
+static void buildPlanTables(Device *device) {
+  ModelParams p, u;
+  device->mpcUpdates = device->model.updates;
+  device->mpcLevels = 0;
+  modelParams(&device->model, &p, &u);
+  if (device->model.updates < MPC_MIN_UPDATES || !(p.capacity > 0) ||
+      !(p.conductance > 0) || !(p.fanGain > 0) ||
+      !(u.capacity < MPC_MAX_UNCERTAINTY) ||
+      !(u.conductance < MPC_MAX_UNCERTAINTY) ||
+      !(u.fanGain < MPC_MAX_UNCERTAINTY) ||
+      !(u.ambient < MPC_MAX_UNCERTAINTY))
+    return;
+  unsigned int speed = device->minFanSpeed, n = 0;
+  for (;;) {
+    const double cooling = p.conductance + p.fanGain * speed / 100.0;
+    device->mpcSpeeds[n] = speed;
+    device->mpcDecay[n] = exp(-MPC_STEP_MS / 1000.0 * cooling / p.capacity);
+    device->mpcHeating[n] = 1 / cooling;
+    device->mpcEffort[n] = (double)speed * speed * speed;
+    n++;
+    if (speed >= device->maxFanSpeed || n == MPC_LEVELS)
+      break;
+    speed = speed + MPC_GRID < device->maxFanSpeed ? speed + MPC_GRID
+                                                   : device->maxFanSpeed;
+  }
+  device->mpcAmbient = p.ambient;
+  device->mpcLevels = n;
+}
+
+/* Predicts steps of MPC_STEP_MS at fan level l from temp, with the power
+ * forecast at step k of power[k]. Returns the hottest temperature reached
+ * and leaves the last one in temp. */
+static double predictTemp(const Device *device, const unsigned int l,
+                          const double *power, const unsigned int from,
+                          const unsigned int to, double *temp) {
+  const double decay = device->mpcDecay[l], heating = device->mpcHeating[l];
+  double t = *temp, peak = t;
+  for (unsigned int k = from; k < to; k++) {
+    const double target = device->mpcAmbient + power[k] * heating;
+    t = target + (t - target) * decay;
+    if (t > peak)
+      peak = t;
+  }
+  *temp = t;
+  return peak;
+}
+
+/* Picks the fan speed for now by planning MPC_HORIZON_MS ahead on the
+ * fitted model, with the power extrapolated along its recent trend. A plan
+ * holds one speed for MPC_HOLD_MS and another for the rest, and the
+ * cheapest one by fan power that keeps the temperature below MPC_CEILING_C
+ * wins. Only its first move is used, the next tick plans again. The search
+ * walks the first speed upwards and bisects the second, which is enough as
+ * a faster fan never runs hotter. Returns -1 while the model is not
+ * trusted, and the highest speed when no plan stays below the ceiling. */
+static int planFanSpeed(Device *device, const unsigned long long now,
+                        const unsigned int temperature,
+                        const unsigned int power) {
+  const double watts = power / 1000.0;
+  if (device->mpcAt && now > device->mpcAt) {
+    const double dt = now - device->mpcAt;
+    const double slope = (watts - device->mpcPower) * 1000 / dt;
+    const double weight = dt < MPC_TREND_MS ? dt / MPC_TREND_MS : 1;
+    device->mpcTrend += (slope - device->mpcTrend) * weight;
+  }
+  device->mpcAt = now;
+  device->mpcPower = watts;
+  if (device->mpcUpdates != device->model.updates)
+    buildPlanTables(device);
+  if (!device->mpcLevels)
+    return -1;
+
+  const double rated =
+      device->powerRated ? device->powerRated / 1000.0 : HINT_RATED_W;
+  const double most = watts > rated ? watts : rated;
+  double forecast[MPC_STEPS];
+  for (unsigned int k = 0; k < MPC_STEPS; k++) {
+    const double p = watts + device->mpcTrend * (k + 0.5) * MPC_STEP_MS / 1000;
+    forecast[k] = p < 0 ? 0 : p > most ? most : p;
+  }
+  double best = INFINITY;
+  int plan = device->mpcSpeeds[device->mpcLevels - 1];
+  for (unsigned int first = 0; first < device->mpcLevels; first++) {
+    const double held = device->mpcEffort[first] * MPC_HOLD_STEPS;
+    if (held >= best)
+      break;
+    double start = temperature;
+    if (predictTemp(device, first, forecast, 0, MPC_HOLD_STEPS, &start) >
+        MPC_CEILING_C)
+      continue;
+    unsigned int low = 0, high = device->mpcLevels;
+    while (low < high) {
+      const unsigned int mid = (low + high) / 2;
+      double t = start;
+      if (predictTemp(device, mid, forecast, MPC_HOLD_STEPS, MPC_STEPS, &t) >
+          MPC_CEILING_C)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    if (low == device->mpcLevels)
+      continue;
+    const double cost =
+        held + device->mpcEffort[low] * (MPC_STEPS - MPC_HOLD_STEPS);
+    if (cost < best) {
+      best = cost;
+      plan = device->mpcSpeeds[first];
+    }
+  }
+  return plan;
+}
+
+/* Appends a sample to the device's history ring, for the main thread to
+ * write out. Only memory is touched here. A full ring drops the sample. */
+static void recordHistory(Device *device, const unsigned long long now,
+                          const unsigned int temperature,
+                          const unsigned int fan) {
+  const unsigned int head =
+      atomic_load_explicit(&device->historyHead, memory_order_relaxed);
+  if (head - atomic_load_explicit(&device->historyTail,
+                                  memory_order_acquire) >= HISTORY_RING) {
+    device->historyDropped++;
+    return;
+  }
+  HistorySample *sample = &device->history[head % HISTORY_RING];
+  sample->ms = now / 10 * 10; // steady deltas despite wakeup jitter
+  sample->temperature = temperature < 255 ? temperature : 255;
+  sample->fan = fan;
+  atomic_store_explicit(&device->historyHead, head + 1, memory_order_release);
+}
+
+/* One control step: reads the temperature, picks a target per fan and ramps
+ * towards it. Returns the delay in ms until the next step, or 0 once the
+ * device is lost. */
+static unsigned int deviceTick(Device *device) {
+  const unsigned int polling_interval = 1000; // ms
+  unsigned int temperature;
+  nvmlReturn_t result = nvml.DeviceGetTemperature(
+      device->handle, NVML_TEMPERATURE_GPU, &temperature);
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to get temperature for device %d: %s\n", device->id,
+                nvml.ErrorString(result));
+    if (result == NVML_ERROR_GPU_IS_LOST ||
+        ++device->failures >= LOST_READ_FAILURES) {
+      DEBUG_PRINT("Device %d lost, retiring\n", device->id);
+      return 0;
+    }
+    return polling_interval;
+  }
+  device->failures = 0;
+
+  if (COUPLED_MODE &&
+      device->neighbourGeneration != atomic_load(&registryGeneration))
+    findNeighbours(device);
+
+  unsigned int temp_diff = device->prevTemperature > temperature
+                               ? device->prevTemperature - temperature
+                               : temperature - device->prevTemperature;
+
+  unsigned int controlTemp = temperature;
+  unsigned int floor = 0;
+  if (device->neighbourCount)
+    coupleNeighbours(device, &controlTemp, &floor);
+  // The fans left carry the load of a stalled one
+  if (device->fallbackMode && device->stalledFans)
+    floor = device->maxFanSpeed;
+  // A hot inlet moves the curve to cooler temperatures, see readAmbient()
+  const int shift = atomic_load_explicit(&ambientShift, memory_order_relaxed);
+  controlTemp = (int)controlTemp + shift > 0 ? controlTemp + shift : 0;
+
+  /* Intermediate ramp steps are paced by the device loop's own timer */
+  const unsigned long long now = monotonicMs();
+  unsigned long long reasons = 0;
+  if (watchesThrottle(device) && nvml.DeviceGetCurrentClocksEventReasons &&
+      nvml.DeviceGetCurrentClocksEventReasons(device->handle, &reasons) ==
+          NVML_SUCCESS) {
+    updateThrottle(device, reasons, now);
+    if (device->perfMode) {
+      const int loaded = !(reasons & nvmlClocksEventReasonGpuIdle);
+      unsigned int clock = 0;
+      if (loaded && nvml.DeviceGetClockInfo &&
+          nvml.DeviceGetClockInfo(device->handle, NVML_CLOCK_SM, &clock) ==
+              NVML_SUCCESS)
+        learnBoostSteps(device, temperature, clock);
+      device->smClock = clock;
+      updatePerfBoost(device, temperature, clock != 0);
+    }
+  }
+  if (device->precoolMode && nvml.DeviceGetComputeRunningProcesses &&
+      now - device->processCheckAt >= PROCESS_WATCH_MS) {
+    device->processCheckAt = now;
+    watchProcesses(device, now);
+  }
+  if (device->precoolBoost && now >= device->precoolUntil)
+    device->precoolBoost = 0;
+  device->hintBoost = hintBoost(device, now);
+  const unsigned int boost = device->throttleBoost + device->perfBoost +
+                             device->precoolBoost + device->hintBoost;
+  unsigned int power = 0;
+  const int havePower =
+      (chassisPower || device->modelMode) && nvml.DeviceGetPowerUsage &&
+      nvml.DeviceGetPowerUsage(device->handle, &power) == NVML_SUCCESS;
+  if (havePower)
+    atomic_store_explicit(&device->power, power, memory_order_relaxed);
+  device->mpcPlan = device->mpcMode && havePower
+                        ? planFanSpeed(device, now, temperature, power)
+                        : -1;
+  const unsigned int t = tempIndex(controlTemp);
+  unsigned int highest = 0, commanded = 0, fanSum = 0;
+  int ramping = 0;
+  for (unsigned int i = 0; i < device->fanCount; i++) {
+    Fan *fan = &device->fans[i];
+    unsigned int fanSpeed = getFanSpeed(fan, t);
+    // Plans start at the card's minimum, stopping the fans is the curve's
+    if (device->mpcPlan >= 0 &&
+        (fanSpeed || device->mpcPlan > (int)device->minFanSpeed))
+      fanSpeed = device->mpcPlan;
+    if (fanSpeed < floor)
+      fanSpeed =
+          clampFanSpeed(floor, device->minFanSpeed, device->maxFanSpeed);
+    if (boost)
+      fanSpeed = clampFanSpeed(fanSpeed + boost, device->minFanSpeed,
+                               device->maxFanSpeed);
+    if (fanSpeed > highest)
+      highest = fanSpeed;
+    if (fan->targetFanSpeed != fanSpeed) {
+      DEBUG_PRINT("Monitoring device: %d temp: %d->%d fan:%d target:%d->%d\n",
+                  device->id, device->prevTemperature, temperature, i,
+                  fan->targetFanSpeed, fanSpeed);
+      fan->targetFanSpeed = fanSpeed;
+    }
+    ramping |= rampFanSpeed(device, i, now);
+    if (fan->prevFanSpeed > commanded)
+      commanded = fan->prevFanSpeed;
+    fanSum += fan->prevFanSpeed;
+  }
+  if (device->powerLimitOrig)
+    updatePowerCap(device, temperature, highest >= device->maxFanSpeed, now);
+  device->prevTemperature = temperature;
+  atomic_store_explicit(&device->snapshot, temperature << 16 | highest,
+                        memory_order_relaxed);
+  if (!havePower)
+    device->modelStart = 0;
+  else if (device->modelMode && device->fanCount)
+    trackModel(device, now, temperature, fanSum / device->fanCount, power);
+
+  if (++device->tick % FAN_CHECK_TICKS == 0)
+    checkFans(device, now);
+  // A tenth of slack so that a tick woken slightly early still counts
+  if (HISTORY_MODE &&
+      now - device->historyAt >= HISTORY_INTERVAL_MS * 9 / 10) {
+    device->historyAt = now;
+    recordHistory(device, now, temperature, commanded);
+  }
+  if (device->flightMode)
+    recordFlight(device, now, temperature, controlTemp, commanded, boost,
+                 ramping);
+
+  if (ramping)
+    return RAMP_STEP_MS;
+  if (device->flightUntil)
+    return FLIGHT_FAST_MS;
+  if (device->hintBoost)
+    return HINT_POLL_MS;
+  return (temp_diff > 5) ? polling_interval / 2 : polling_interval;
+}
+
+void *deviceLoop(void *arg) {
+  Device *device = (Device *)arg;
+  nvmlReturn_t result;
+
+  placeDeviceThread(device);
+  setTimerSlack();
+
+  result = nvml.DeviceGetNumFans(device->handle, &device->fanCount);
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to get fan count for device %d: %s\n", device->id,
+                nvml.ErrorString(result));
+    device->fanCount = 0;
+    // A passive GPU still heats the chassis fans' air
+    device->retire = !CHASSIS_MODE && !BMC_MODE;
+    device->failed = device->retire;
+  }
+  if (device->fanCount > MAX_FANS) {
+    DEBUG_PRINT("Device %d has %d fans, controlling the first %d\n",
+                device->id, device->fanCount, MAX_FANS);
+    device->fanCount = MAX_FANS;
+  }
+
+  result = nvml.DeviceGetMinMaxFanSpeed(device->handle, &device->minFanSpeed,
+                                       &device->maxFanSpeed);
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to get fan range for device %d: %s\n", device->id,
+                nvml.ErrorString(result));
+    device->minFanSpeed = 0;
+    device->maxFanSpeed = 100;
+  }
+
+  if (COUPLED_MODE)
+    findNeighbours(device);
+
+  for (unsigned int i = 0; i < device->fanCount; i++) {
+    Fan *fan = &device->fans[i];
+    precalcFanTable(fanCurveTable(i), &fan->table, device->minFanSpeed,
+                    device->maxFanSpeed);
+    fan->prevFanSpeed = 1; // 1 avoids gate overlap with 0 RPM
+    fan->targetFanSpeed = 1;
+    fan->holdUntil = 0;
+    fan->changedAt = 0;
+  }
+
+  if (POWER_CAP_MODE)
+    initPowerCap(device);
+  if (HINT_MODE && nvml.DeviceGetPowerManagementLimit)
+    nvml.DeviceGetPowerManagementLimit(device->handle, &device->powerRated);
+
+  /* Resume where the previous process left off. The fans never left manual
+   * control and monotonic timestamps are still valid after exec. */
+  const HandoffState *h = device->handoff;
+  if (h) {
+    device->prevTemperature = h->prevTemperature;
+    for (unsigned int i = 0; i < device->fanCount && i < h->fanCount; i++) {
+      Fan *fan = &device->fans[i];
+      fan->prevFanSpeed = h->fans[i].prevFanSpeed;
+      fan->targetFanSpeed = h->fans[i].targetFanSpeed;
+      fan->holdUntil = h->fans[i].holdUntil;
+      fan->changedAt = h->fans[i].changedAt;
+      fan->errorAvg16 = h->fans[i].errorAvg16;
+      fan->checks = h->fans[i].checks;
+      fan->lagCount = h->fans[i].lagCount;
+      fan->stallCount = h->fans[i].stallCount;
+      fan->degradedCount = h->fans[i].degradedCount;
+      fan->health = h->fans[i].health <= FAN_STALLED ? h->fans[i].health : 0;
+      device->stalledFans += fan->health == FAN_STALLED;
+    }
+    DEBUG_PRINT("Device %d resumed from handoff\n", device->id);
+    device->handoff = NULL;
+  }
+
+  /* LOOP */
+  unsigned long long nextWake = monotonicMs();
+  while (!terminate && !device->retire) {
+    const unsigned int delay = deviceTick(device);
+    if (delay == 0) {
+      device->failed = 1;
+      break;
+    }
+    nextWake += delay;
+    const unsigned long long now = monotonicMs();
+    if (nextWake < now)
+      nextWake = now;
+    sleepUntilMs(nextWake);
+  }
+  /* End LOOP */
+
+  /* Terminate signaled reset fan control to firmware. A handoff leaves the
+   * fans at their commanded speed for the next process. */
+  for (unsigned int i = 0; i < device->fanCount && !handoff; i++) {
+    result = nvml.DeviceSetDefaultFanSpeed(device->handle, i);
+    if (result != NVML_SUCCESS) {
+      DEBUG_PRINT(
+          "Failed to set fan: %d to firmware default for device:%d: %s\n", i,
+          device->id, nvml.ErrorString(result));
+    }
+  }
+  if (!handoff && device->powerLimitOrig &&
+      device->powerLimit != device->powerLimitOrig) {
+    result = nvml.DeviceSetPowerManagementLimit(device->handle,
+                                                device->powerLimitOrig);
+    if (result != NVML_SUCCESS) {
+      DEBUG_PRINT("Failed to restore power limit for device %d: %s\n",
+                  device->id, nvml.ErrorString(result));
+    }
+  }
+
+  // A capture cut short by a lost GPU is the one most worth keeping
+  if (device->flightUntil)
+    finishFlight(device, monotonicMs());
+  DEBUG_PRINT("Device %d thread terminated\n", device->id);
+  atomic_store(&device->snapshot, 0);
+  atomic_store(&device->power, 0);
+  atomic_store(&device->state, SLOT_EXITED);
+  return NULL;
+}
+
+/* Returns the registry slot the device was adopted into, or -1. */
+static int adoptDevice(const nvmlDevice_t handle, const unsigned int index,
+                       const char *uuid) {
+  int slot = -1;
+  for (unsigned int i = 0; i < MAX_DEVICES && slot < 0; i++) {
+    if (atomic_load(&registry[i].state) == SLOT_FREE)
+      slot = i;
+  }
+  if (slot < 0) {
+    DEBUG_PRINT("No free slot for device %d, raise MAX_DEVICES\n", index);
+    return -1;
+  }
+
+  Device *device = &registry[slot];
+  memset(device, 0, sizeof(Device));
+  device->handle = handle;
+  device->id = index;
+  device->adoptedAt = monotonicMs();
+  snprintf(device->uuid, sizeof(device->uuid), "%s", uuid);
+  nvmlPciInfo_t pci;
+  if (nvml.DeviceGetPciInfo(handle, &pci) == NVML_SUCCESS)
+    snprintf(device->busId, sizeof(device->busId), "%s", pci.busId);
+
+  for (unsigned int i = 0; i < handoffCount; i++) {
+    if (strcmp(handoffStates[i].uuid, uuid) == 0)
+      device->handoff = &handoffStates[i];
+  }
+
+  device->rampUpRate = RAMP_UP_RATE;
+  device->rampDownRate = RAMP_DOWN_RATE;
+  device->minHoldMs = MIN_HOLD_MS;
+  device->perfMode = PERF_MODE;
+  device->precoolMode = PRECOOL_MODE;
+  device->flightMode = FLIGHT_MODE;
+  device->fallbackMode = FAN_FALLBACK_MODE;
+  device->throttleStep = THROTTLE_BOOST_STEP;
+  device->placement = PLACEMENT;
+  device->modelMode = MODEL_MODE;
+  device->mpcMode = MPC_MODE;
+  device->mpcPlan = -1;
+  const ModelRecord *record = findModel(uuid, device->busId);
+  if (record)
+    device->model = record->model;
+  else
+    initModel(&device->model);
+  for (const RampOverride *o = RampOverrides; o->id >= 0; o++) {
+    if (o->id == (int)index) {
+      device->rampUpRate = o->rampUpRate;
+      device->rampDownRate = o->rampDownRate;
+      device->minHoldMs = o->minHoldMs;
+    }
+  }
+
+  // Device threads inherit a mask that leaves signals to the main thread
+  sigset_t mask, prevMask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, &prevMask);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, DEVICE_STACK_SIZE);
+  atomic_store(&device->state, SLOT_ACTIVE);
+  const int created =
+      pthread_create(&device->thread, &attr, deviceLoop, device) == 0;
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &prevMask, NULL);
+  if (!created) {
+    DEBUG_PRINT("Failed to create thread for device %d\n", index);
+    atomic_store(&device->state, SLOT_FREE);
+    return -1;
+  }
+
+  DEBUG_PRINT("Adopted device %d %s at %s\n", index, uuid, device->busId);
+  atomic_fetch_add(&registryGeneration, 1);
+  return slot;
+}
+
+static RetryState *findRetry(const char *uuid) {
+  for (unsigned int i = 0; i < retryCount; i++) {
+    if (strcmp(retries[i].uuid, uuid) == 0)
+      return &retries[i];
+  }
+  return NULL;
+}
+
+/* Holds off adopting a GPU whose thread gave up on it, for RETRY_MIN_MS at
+ * first and twice as long after every failure since, up to RETRY_MAX_MS.
+ * A GPU that ran that long before failing starts over. */
+static void delayRetry(const Device *device, const unsigned long long now) {
+  RetryState *retry = findRetry(device->uuid);
+  if (!retry) {
+    if (retryCount == MAX_DEVICES)
+      return;
+    retry = &retries[retryCount++];
+    snprintf(retry->uuid, sizeof(retry->uuid), "%s", device->uuid);
+    retry->waitMs = 0;
+  }
+  if (!retry->waitMs || now - device->adoptedAt >= RETRY_MAX_MS)
+    retry->waitMs = RETRY_MIN_MS;
+  else if (retry->waitMs < RETRY_MAX_MS / 2)
+    retry->waitMs *= 2;
+  else
+    retry->waitMs = RETRY_MAX_MS;
+  retry->retryAt = now + retry->waitMs;
+  DEBUG_PRINT("Device %s failed, retrying in %llums\n", device->uuid,
+              retry->waitMs);
+}
+
+/* Joins the threads of lost devices, retires devices NVML no longer lists
+ * and adopts any it lists that are not controlled yet, unless they failed
+ * too recently. Healthy devices are left alone. Returns the number of
+ * active devices. */
+static unsigned int rescanDevices(void) {
+  const unsigned long long now = monotonicMs();
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) == SLOT_EXITED) {
+      pthread_join(registry[i].thread, NULL);
+      if (registry[i].failed)
+        delayRetry(&registry[i], now);
+      if (HISTORY_MODE)
+        flushDeviceHistory(HISTORY_DIR, &registry[i]);
+      if (FLIGHT_MODE)
+        dumpFlight(FLIGHT_DIR, &registry[i]);
+      if (MODEL_MODE)
+        storeModel(&registry[i]);
+      atomic_store(&registry[i].state, SLOT_FREE);
+      atomic_fetch_add(&registryGeneration, 1);
+    }
+  }
+
+  unsigned int count = 0;
+  nvmlReturn_t result = nvml.DeviceGetCount(&count);
+  if (result != NVML_SUCCESS) {
+    DEBUG_PRINT("Failed to get device count: %s\n", nvml.ErrorString(result));
+    return 0;
+  }
+
+  int seen[MAX_DEVICES] = {0};
+  for (unsigned int index = 0; index < count; index++) {
+    nvmlDevice_t handle;
+    char uuid[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+    result = nvml.DeviceGetHandleByIndex(index, &handle);
+    if (result == NVML_SUCCESS)
+      result = nvml.DeviceGetUUID(handle, uuid, sizeof(uuid));
+    if (result != NVML_SUCCESS) {
+      DEBUG_PRINT("Failed to get device %d handle: %s\n", index,
+                  nvml.ErrorString(result));
+      continue;
+    }
+
+    int slot = -1;
+    for (unsigned int i = 0; i < MAX_DEVICES && slot < 0; i++) {
+      if (atomic_load(&registry[i].state) == SLOT_ACTIVE &&
+          strcmp(registry[i].uuid, uuid) == 0)
+        slot = i;
+    }
+    const RetryState *retry = findRetry(uuid);
+    if (slot < 0 && retry && now < retry->retryAt)
+      continue;
+    if (slot < 0)
+      slot = adoptDevice(handle, index, uuid);
+    if (slot >= 0)
+      seen[slot] = 1;
+  }
+
+  unsigned int active = 0;
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    if (atomic_load(&registry[i].state) != SLOT_ACTIVE)
+      continue;
+    if (!seen[i]) {
+      DEBUG_PRINT("Device %s is gone, retiring\n", registry[i].uuid);
+      registry[i].retire = 1;
+      continue;
+    }
+    active++;
+  }
+  return active;
+}
+
+/* Writes per fan state and health counters in Prometheus text format, e.g.
+ * for the node_exporter textfile collector. The file is replaced atomically.
+ */
+static void writeStatus(void) {
+  const char *tmpPath = STATUS_PATH ".tmp";
+  FILE *f = fopen(tmpPath, "w");
+  if (!f) {
+    DEBUG_PRINT("Failed to open %s\n", tmpPath);
+    return;
+  }
+
+  fprintf(f, "# TYPE fancontroller_fan_commanded_percent gauge\n"
+             "# TYPE fancontroller_fan_actual_percent gauge\n"
+             "# TYPE fancontroller_fan_error_avg_percent gauge\n"
+             "# TYPE fancontroller_fan_health gauge\n"
+             "# TYPE fancontroller_fan_checks_total counter\n"
+             "# TYPE fancontroller_fan_lag_total counter\n"
+             "# TYPE fancontroller_fan_degraded_total counter\n"
+             "# TYPE fancontroller_fan_stall_total counter\n"
+             "# TYPE fancontroller_gpu_fan_fallback gauge\n"
+             "# TYPE fancontroller_gpu_throttled gauge\n"
+             "# TYPE fancontroller_gpu_throttled_seconds_total counter\n"
+             "# TYPE fancontroller_gpu_throttle_events_total counter\n"
+             "# TYPE fancontroller_gpu_sm_clock_mhz gauge\n"
+             "# TYPE fancontroller_gpu_perf_boost_percent gauge\n"
+             "# TYPE fancontroller_gpu_boost_steps gauge\n"
+             "# TYPE fancontroller_gpu_power_limit_watts gauge\n"
+             "# TYPE fancontroller_gpu_power_capped gauge\n"
+             "# TYPE fancontroller_gpu_compute_processes gauge\n"
+             "# TYPE fancontroller_gpu_precool_boost_percent gauge\n"
+             "# TYPE fancontroller_gpu_precool_events_total counter\n"
+             "# TYPE fancontroller_gpu_hint_boost_percent gauge\n"
+             "# TYPE fancontroller_hints_total counter\n"
+             "# TYPE fancontroller_ambient_celsius gauge\n"
+             "# TYPE fancontroller_ambient_shift_celsius gauge\n"
+             "# TYPE fancontroller_chassis_pwm gauge\n"
+             "# TYPE fancontroller_chassis_writes_total counter\n"
+             "# TYPE fancontroller_bmc_zone_duty_percent gauge\n"
+             "# TYPE fancontroller_bmc_batches_total counter\n"
+             "# TYPE fancontroller_bmc_commands_total counter\n"
+             "# TYPE fancontroller_bmc_errors_total counter\n"
+             "# TYPE fancontroller_history_samples_total counter\n"
+             "# TYPE fancontroller_history_bytes_total counter\n"
+             "# TYPE fancontroller_gpu_history_dropped_total counter\n"
+             "# TYPE fancontroller_flight_dumps_total counter\n"
+             "# TYPE fancontroller_gpu_flight_triggers_total counter\n"
+             "# TYPE fancontroller_gpu_model_capacity_joules_per_celsius "
+             "gauge\n"
+             "# TYPE fancontroller_gpu_model_conductance_watts_per_celsius "
+             "gauge\n"
+             "# TYPE fancontroller_gpu_model_ambient_celsius gauge\n"
+             "# TYPE fancontroller_gpu_model_uncertainty_ratio gauge\n"
+             "# TYPE fancontroller_gpu_model_error_celsius_per_second gauge\n"
+             "# TYPE fancontroller_gpu_model_updates_total counter\n"
+             "# HELP fancontroller_gpu_mpc_active 1 while the fans follow "
+             "the plan on the thermal model, 0 while the curve runs them.\n"
+             "# TYPE fancontroller_gpu_mpc_active gauge\n"
+             "# HELP fancontroller_gpu_mpc_fan_percent Fan speed planned "
+             "on the thermal model, only while it is followed.\n"
+             "# TYPE fancontroller_gpu_mpc_fan_percent gauge\n"
+             "# TYPE fancontroller_wakeups_total counter\n"
+             "# TYPE fancontroller_wakeup_instants_total counter\n");
+  if (HINT_MODE) {
+    fprintf(f, "fancontroller_hints_total{result=\"accepted\"} %llu\n",
+            hintsAccepted);
+    fprintf(f, "fancontroller_hints_total{result=\"rejected\"} %llu\n",
+            hintsRejected);
+  }
+  if (ambientMilli != INT_MIN)
+    fprintf(f, "fancontroller_ambient_celsius %.3f\n", ambientMilli / 1000.0);
+  if (ambientCount)
+    fprintf(f, "fancontroller_ambient_shift_celsius %d\n",
+            atomic_load(&ambientShift));
+  for (unsigned int i = 0; i < chassisCount; i++) {
+    const ChassisState *c = &chassis[i];
+    if (c->pwm >= 0)
+      fprintf(f, "fancontroller_chassis_pwm{chip=\"%s\",pwm=\"%u\"} %d\n",
+              c->fan->chip, c->fan->pwm, c->pwm);
+    fprintf(f,
+            "fancontroller_chassis_writes_total{chip=\"%s\",pwm=\"%u\"} "
+            "%llu\n",
+            c->fan->chip, c->fan->pwm, c->writes);
+  }
+  for (unsigned int i = 0; i < bmc.zoneCount; i++) {
+    if (bmc.duty[i] >= 0)
+      fprintf(f, "fancontroller_bmc_zone_duty_percent{zone=\"%s\"} %d\n",
+              bmc.zones[i].name, bmc.duty[i]);
+  }
+  if (bmc.zoneCount) {
+    fprintf(f, "fancontroller_bmc_batches_total %llu\n", bmc.batches);
+    fprintf(f, "fancontroller_bmc_commands_total %llu\n", bmc.commands);
+    fprintf(f, "fancontroller_bmc_errors_total %llu\n", bmc.errors);
+  }
+  if (HISTORY_MODE) {
+    fprintf(f, "fancontroller_history_samples_total %llu\n", historySamples);
+    fprintf(f, "fancontroller_history_bytes_total %llu\n", historyBytes);
+  }
+  if (FLIGHT_MODE)
+    fprintf(f, "fancontroller_flight_dumps_total %llu\n", flightDumps);
+  fprintf(f, "fancontroller_wakeups_total %llu\n",
+          atomic_load_explicit(&wakeups, memory_order_relaxed));
+  fprintf(f, "fancontroller_wakeup_instants_total %llu\n",
+          atomic_load_explicit(&wakeupInstants, memory_order_relaxed));
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    const Device *device = &registry[d];
+    if (atomic_load(&device->state) != SLOT_ACTIVE)
+      continue;
+    const unsigned long long since = device->throttledSince;
+    const unsigned long long throttledMs =
+        device->throttledMs + (since ? monotonicMs() - since : 0);
+    if (watchesThrottle(device)) {
+      fprintf(f, "fancontroller_gpu_throttled{gpu=\"%s\"} %d\n",
+              device->uuid, since != 0);
+      fprintf(f,
+              "fancontroller_gpu_throttled_seconds_total{gpu=\"%s\"} %.3f\n",
+              device->uuid, throttledMs / 1000.0);
+      fprintf(f, "fancontroller_gpu_throttle_events_total{gpu=\"%s\"} %u\n",
+              device->uuid, device->throttleEvents);
+    }
+    if (device->perfMode) {
+      fprintf(f, "fancontroller_gpu_sm_clock_mhz{gpu=\"%s\"} %u\n",
+              device->uuid, device->smClock);
+      fprintf(f, "fancontroller_gpu_perf_boost_percent{gpu=\"%s\"} %u\n",
+              device->uuid, device->perfBoost);
+      fprintf(f, "fancontroller_gpu_boost_steps{gpu=\"%s\"} %d\n",
+              device->uuid, __builtin_popcountll(device->perfSteps));
+    }
+    if (device->powerLimitOrig) {
+      fprintf(f, "fancontroller_gpu_power_limit_watts{gpu=\"%s\"} %.3f\n",
+              device->uuid, device->powerLimit / 1000.0);
+      fprintf(f, "fancontroller_gpu_power_capped{gpu=\"%s\"} %d\n",
+              device->uuid, device->powerLimit < device->powerLimitOrig);
+    }
+    if (HISTORY_MODE)
+      fprintf(f, "fancontroller_gpu_history_dropped_total{gpu=\"%s\"} %u\n",
+              device->uuid, device->historyDropped);
+    for (unsigned int i = 0;
+         device->flightMode && i < COUNT_OF(FlightReasonNames); i++)
+      fprintf(f,
+              "fancontroller_gpu_flight_triggers_total{gpu=\"%s\","
+              "reason=\"%s\"} %u\n",
+              device->uuid, FlightReasonNames[i], device->flightTriggers[i]);
+    if (device->modelMode) {
+      ThermalModel model;
+      ModelParams p, u;
+      readModel(device, &model);
+      modelParams(&model, &p, &u);
+#define MODEL_METRIC(name, labels, value)                                      \
+  fprintf(f, "fancontroller_gpu_model_" name "{gpu=\"%s\"" labels "} %g\n",  \
+          device->uuid, value)
+      MODEL_METRIC("capacity_joules_per_celsius", "", p.capacity);
+      MODEL_METRIC("conductance_watts_per_celsius", ",fan=\"0\"",
+                   p.conductance);
+      MODEL_METRIC("conductance_watts_per_celsius", ",fan=\"100\"",
+                   p.conductance + p.fanGain);
+      MODEL_METRIC("ambient_celsius", "", p.ambient);
+      MODEL_METRIC("uncertainty_ratio", ",param=\"capacity\"", u.capacity);
+      MODEL_METRIC("uncertainty_ratio", ",param=\"conductance\"",
+                   u.conductance);
+      MODEL_METRIC("uncertainty_ratio", ",param=\"fan_gain\"", u.fanGain);
+      MODEL_METRIC("uncertainty_ratio", ",param=\"ambient\"", u.ambient);
+      MODEL_METRIC("error_celsius_per_second", "", sqrt(model.noise));
+#undef MODEL_METRIC
+      fprintf(f, "fancontroller_gpu_model_updates_total{gpu=\"%s\"} %llu\n",
+              device->uuid, model.updates);
+    }
+    if (device->mpcMode) {
+      fprintf(f, "fancontroller_gpu_mpc_active{gpu=\"%s\"} %d\n",
+              device->uuid, device->mpcPlan >= 0);
+      if (device->mpcPlan >= 0)
+        fprintf(f, "fancontroller_gpu_mpc_fan_percent{gpu=\"%s\"} %d\n",
+                device->uuid, device->mpcPlan);
+    }
+    if (HINT_MODE)
+      fprintf(f, "fancontroller_gpu_hint_boost_percent{gpu=\"%s\"} %u\n",
+              device->uuid, device->hintBoost);
+    if (device->precoolMode) {
+      fprintf(f, "fancontroller_gpu_compute_processes{gpu=\"%s\"} %u\n",
+              device->uuid, device->processCount);
+      fprintf(f, "fancontroller_gpu_precool_boost_percent{gpu=\"%s\"} %u\n",
+              device->uuid, device->precoolBoost);
+      fprintf(f, "fancontroller_gpu_precool_events_total{gpu=\"%s\"} %u\n",
+              device->uuid, device->precoolEvents);
+    }
+    if (device->fallbackMode)
+      fprintf(f, "fancontroller_gpu_fan_fallback{gpu=\"%s\"} %d\n",
+              device->uuid, device->stalledFans != 0);
+    for (unsigned int i = 0; i < device->fanCount; i++) {
+      const Fan *fan = &device->fans[i];
+      const char *health = FanHealthNames[fan->health];
+#define FAN_METRIC(name, fmt, value)                                           \
+  fprintf(f, "fancontroller_fan_" name "{gpu=\"%s\",fan=\"%u\"} " fmt "\n",    \
+          device->uuid, i, value)
+      FAN_METRIC("commanded_percent", "%u", fan->prevFanSpeed);
+      FAN_METRIC("actual_percent", "%u", fan->actualFanSpeed);
+      FAN_METRIC("error_avg_percent", "%.2f", fan->errorAvg16 / 16.0);
+      fprintf(f,
+              "fancontroller_fan_health{gpu=\"%s\",fan=\"%u\",state=\"%s\"} "
+              "%d\n",
+              device->uuid, i, health, fan->health);
+      FAN_METRIC("checks_total", "%u", fan->checks);
+      FAN_METRIC("lag_total", "%u", fan->lagCount);
+      FAN_METRIC("degraded_total", "%u", fan->degradedCount);
+      FAN_METRIC("stall_total", "%u", fan->stallCount);
+#undef FAN_METRIC
+    }
+  }
+
+  if (fclose(f) != 0 || rename(tmpPath, STATUS_PATH) != 0) {
+    DEBUG_PRINT("Failed to write %s\n", STATUS_PATH);
+    unlink(tmpPath);
+  }
+}
+
+static void setHint(Device *device, const unsigned int watts,
+                    const unsigned int startMs, unsigned int durationMs,
+                    const unsigned long long now) {
+  if (durationMs > HINT_MAX_MS)
+    durationMs = HINT_MAX_MS;
+  atomic_store_explicit(&device->hintWatts, 0, memory_order_relaxed);
+  atomic_store_explicit(&device->hintStart, now + startMs,
+                        memory_order_relaxed);
+  atomic_store_explicit(&device->hintEnd, now + startMs + durationMs,
+                        memory_order_relaxed);
+  atomic_store_explicit(&device->hintWatts, watts, memory_order_release);
+}
+
+/* Hints are datagrams of one or more lines
+ *
+ *   <gpu> <watts> <start in ms> <duration in ms>
+ *
+ * where gpu is an NVML index, UUID or PCI bus ID. A new hint replaces the
+ * GPU's previous one, 0 watts cancels it. */
+static void handleHints(char *buf, const unsigned long long now) {
+  char *save;
+  for (char *line = strtok_r(buf, "\n", &save); line;
+       line = strtok_r(NULL, "\n", &save)) {
+    char gpu[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+    unsigned int watts, startMs, durationMs;
+    if (sscanf(line, "%95s %u %u %u", gpu, &watts, &startMs, &durationMs) !=
+        4) {
+      hintsRejected++;
+      continue;
+    }
+
+    char *end;
+    const unsigned long index = strtoul(gpu, &end, 10);
+    Device *device = NULL;
+    for (unsigned int i = 0; i < MAX_DEVICES && !device; i++) {
+      Device *d = &registry[i];
+      if (atomic_load(&d->state) == SLOT_ACTIVE &&
+          (strcmp(d->uuid, gpu) == 0 || strcasecmp(d->busId, gpu) == 0 ||
+           (*end == '\0' && d->id == (int)index)))
+        device = d;
+    }
+    if (!device) {
+      hintsRejected++;
+      continue;
+    }
+
+    setHint(device, watts, startMs, durationMs, now);
+    DEBUG_PRINT("Hint for device %d: %uW in %ums for %ums\n", device->id,
+                watts, startMs, durationMs);
+    hintsAccepted++;
+  }
+}
+
+static int openHintSocket(void) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", HINT_SOCKET);
+  const int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  unlink(HINT_SOCKET);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    DEBUG_PRINT("Failed to bind %s\n", HINT_SOCKET);
+    close(fd);
+    return -1;
+  }
+  chmod(HINT_SOCKET, 0660);
+  return fd;
+}
+
+static void readHints(const int fd) {
+  char buf[1024];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[n] = '\0';
+    handleHints(buf, monotonicMs());
+  }
+}
+
+/* The main thread's sleep, woken early by hints. Otherwise it ends on the
+ * wakeup grid like sleepUntilMs(). */
+static void waitForHints(const int fd, unsigned long long deadline) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  const unsigned long long now = monotonicMs();
+  deadline = onWakeupGrid(deadline);
+  if (deadline > now && poll(&pfd, 1, deadline - now) > 0) {
+    readHints(fd);
+    countWakeup(monotonicMs());
+    return;
+  }
+  countWakeup(deadline);
+}
+
+/* Reads a short sysfs attribute into buf, without its newline. */
+static int readAttribute(const char *path, char *buf, const size_t size) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  const int ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  if (ok)
+    buf[strcspn(buf, "\n")] = '\0';
+  return ok;
+}
+
+static int isAmbientSensor(const char *chip, const char *label) {
+  if (!AmbientSensors[0].chip)
+    return strcasestr(label, "inlet") || strcasestr(label, "ambient");
+  for (const AmbientSensor *a = AmbientSensors; a->chip; a++) {
+    if (strcmp(a->chip, chip) == 0 &&
+        (!a->label || strcmp(a->label, label) == 0))
+      return 1;
+  }
+  return 0;
+}
+
+/* Opens the input of every inlet sensor below root, a tree laid out like
+ * /sys/class/hwmon. The files stay open so a later read is one pread. */
+static void findAmbientSensors(const char *root) {
+  DIR *dir = opendir(root);
+  if (!dir) {
+    DEBUG_PRINT("Failed to open %s\n", root);
+    return;
+  }
+  struct dirent *chipEntry;
+  while ((chipEntry = readdir(dir)) && ambientCount < MAX_AMBIENT_SENSORS) {
+    char path[PATH_MAX], chip[64], label[64];
+    snprintf(path, sizeof(path), "%s/%s", root, chipEntry->d_name);
+    DIR *chipDir = strncmp(chipEntry->d_name, "hwmon", 5) == 0
+                       ? opendir(path)
+                       : NULL;
+    if (!chipDir)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s/name", root, chipEntry->d_name);
+    if (!readAttribute(path, chip, sizeof(chip)))
+      chip[0] = '\0';
+
+    struct dirent *entry;
+    while ((entry = readdir(chipDir)) && ambientCount < MAX_AMBIENT_SENSORS) {
+      unsigned int n;
+      char rest[8];
+      if (sscanf(entry->d_name, "temp%u_%7s", &n, rest) != 2 ||
+          strcmp(rest, "input") != 0)
+        continue;
+      snprintf(path, sizeof(path), "%s/%s/temp%u_label", root,
+               chipEntry->d_name, n);
+      if (!readAttribute(path, label, sizeof(label)))
+        label[0] = '\0';
+      if (!isAmbientSensor(chip, label))
+        continue;
+      snprintf(path, sizeof(path), "%s/%s/%s", root, chipEntry->d_name,
+               entry->d_name);
+      const int fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      DEBUG_PRINT("Inlet sensor %s %s at %s\n", chip, label, path);
+      ambientFds[ambientCount++] = fd;
+    }
+    closedir(chipDir);
+  }
+  closedir(dir);
+}
+
+/* The curve is made for an inlet at AMBIENT_REF. Each degree the hottest
+ * inlet sensor is above or below that moves the curve AMBIENT_GAIN percent
+ * of a degree cooler or warmer, by up to AMBIENT_MAX_SHIFT. Without a
+ * reading the curve stays where it is. */
+static void readAmbient(void) {
+  int hottest = INT_MIN;
+  for (unsigned int i = 0; i < ambientCount; i++) {
+    int milli;
+    if (readNumber(ambientFds[i], &milli) && milli > hottest)
+      hottest = milli;
+  }
+  ambientMilli = hottest;
+
+  int shift = 0;
+  if (hottest != INT_MIN)
+    shift = (hottest - AMBIENT_REF * 1000) * AMBIENT_GAIN / 100000;
+  if (shift > AMBIENT_MAX_SHIFT)
+    shift = AMBIENT_MAX_SHIFT;
+  if (shift < -AMBIENT_MAX_SHIFT)
+    shift = -AMBIENT_MAX_SHIFT;
+  if (shift != atomic_load(&ambientShift))
+    DEBUG_PRINT("Inlet at %dmC, curve shifted %dC\n", hottest, shift);
+  atomic_store_explicit(&ambientShift, shift, memory_order_relaxed);
+}
+
+/* Finds the directory below root, laid out like /sys/class/hwmon, of the
+ * hwmon chip with this name. */
+static int findHwmonChip(const char *root, const char *chip, char *path,
+                         const size_t size) {
+  DIR *dir = opendir(root);
+  if (!dir)
+    return 0;
+  struct dirent *entry;
+  int found = 0;
+  while (!found && (entry = readdir(dir))) {
+    char name[64];
+    if (strncmp(entry->d_name, "hwmon", 5) != 0)
+      continue;
+    snprintf(path, size, "%s/%s/name", root, entry->d_name);
+    found = readAttribute(path, name, sizeof(name)) && strcmp(name, chip) == 0;
+    snprintf(path, size, "%s/%s", root, entry->d_name);
+  }
+  closedir(dir);
+  return found;
+}
+
+/* Puts the PWM outputs listed in fans under manual control, remembering
+ * how they were set for restoreChassisFans(). */
+static void findChassisFans(const char *root, const ChassisFan *fans) {
+  for (const ChassisFan *f = fans; f->chip && chassisCount < MAX_CHASSIS_FANS;
+       f++) {
+    char dir[PATH_MAX], path[PATH_MAX + 32];
+    if (!findHwmonChip(root, f->chip, dir, sizeof(dir))) {
+      DEBUG_PRINT("No hwmon chip %s for pwm%u\n", f->chip, f->pwm);
+      continue;
+    }
+    ChassisState *c = &chassis[chassisCount];
+    snprintf(path, sizeof(path), "%s/pwm%u_enable", dir, f->pwm);
+    c->enableFd = open(path, O_RDWR | O_CLOEXEC);
+    snprintf(path, sizeof(path), "%s/pwm%u", dir, f->pwm);
+    c->pwmFd = open(path, O_RDWR | O_CLOEXEC);
+    if (c->enableFd < 0 || c->pwmFd < 0 ||
+        !readNumber(c->enableFd, &c->enable) ||
+        !readNumber(c->pwmFd, &c->pwmOrig) || !writeNumber(c->enableFd, 1)) {
+      DEBUG_PRINT("Failed to take over %s\n", path);
+      if (c->enableFd >= 0)
+        close(c->enableFd);
+      if (c->pwmFd >= 0)
+        close(c->pwmFd);
+      continue;
+    }
+    DEBUG_PRINT("Chassis fan %s found at mode %d, pwm %d\n", path, c->enable,
+                c->pwmOrig);
+    c->fan = f;
+    c->pwm = -1;
+    c->writes = 0;
+    chassisPower |= f->source == CHASSIS_SUM_POWER;
+    chassisCount++;
+  }
+}
+
+/* The hottest active GPU in C, or the power of all of them in W. */
+static unsigned int chassisInput(const ChassisSource source) {
+  unsigned int value = 0;
+  unsigned long long power = 0;
+  for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+    const Device *device = &registry[i];
+    if (atomic_load(&device->state) != SLOT_ACTIVE)
+      continue;
+    power += atomic_load_explicit(&device->power, memory_order_relaxed);
+    const unsigned int temp =
+        atomic_load_explicit(&device->snapshot, memory_order_relaxed) >> 16;
+    if (temp > value)
+      value = temp;
+  }
+  return source == CHASSIS_SUM_POWER ? power / 1000 : value;
+}
+
+static unsigned int followLine(const unsigned int value,
+                               const unsigned int from, const unsigned int to,
+                               const unsigned int min, const unsigned int max) {
+  if (value <= from)
+    return min;
+  if (value >= to)
+    return max;
+  return min + (max - min) * (value - from) / (to - from);
+}
+
+/* Writes to chassis fans can mean a slow round trip to an embedded
+ * controller, so they only happen when the duty cycle rises, drops by the
+ * deadband or reaches the bottom. A noisy input then settles at the top of
+ * its noise. last is -1 before the first write. */
+static int worthWriting(const int last, const unsigned int duty,
+                        const unsigned int min, const unsigned int deadband) {
+  if (last < 0 || (int)duty > last)
+    return 1;
+  return (int)duty != last &&
+         (last - (int)duty >= (int)deadband || duty == min);
+}
+
+/* Moves every chassis fan onto its line. */
+static void updateChassisFans(void) {
+  const unsigned int temp = chassisInput(CHASSIS_MAX_TEMP);
+  const unsigned int watts = chassisPower ? chassisInput(CHASSIS_SUM_POWER) : 0;
+  for (unsigned int i = 0; i < chassisCount; i++) {
+    ChassisState *c = &chassis[i];
+    const ChassisFan *fan = c->fan;
+    const unsigned int pwm =
+        followLine(fan->source == CHASSIS_SUM_POWER ? watts : temp, fan->from,
+                   fan->to, fan->minPwm, fan->maxPwm);
+    if (!worthWriting(c->pwm, pwm, fan->minPwm, CHASSIS_DEADBAND))
+      continue;
+    if (!writeNumber(c->pwmFd, pwm)) {
+      DEBUG_PRINT("Failed to set chassis fan %s pwm%u to %u\n", fan->chip,
+                  fan->pwm, pwm);
+      continue;
+    }
+    c->pwm = pwm;
+    c->writes++;
+  }
+}
+
+static void initBmc(char *const *argv, const BmcZone *zones) {
+  bmc.argv = argv;
+  bmc.zones = zones;
+  for (bmc.zoneCount = 0;
+       zones[bmc.zoneCount].name && bmc.zoneCount < MAX_BMC_ZONES;
+       bmc.zoneCount++)
+    chassisPower |= zones[bmc.zoneCount].source == CHASSIS_SUM_POWER;
+  for (unsigned int i = 0; i < MAX_BMC_ZONES; i++)
+    bmc.duty[i] = -1;
+}
+
+/* Starts the transport with a socket as its stdin, in its own process group
+ * so a terminal's Ctrl+C does not stop it before the fans are handed
+ * back. */
+static int startBmc(void) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+    return 0;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  const int result =
+      posix_spawnp(&bmc.pid, bmc.argv[0], &actions, &attr, bmc.argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(sv[1]);
+  if (result != 0) {
+    DEBUG_PRINT("Failed to start %s: %s\n", bmc.argv[0], strerror(result));
+    close(sv[0]);
+    return 0;
+  }
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  bmc.fd = sv[0];
+  return 1;
+}
+
+/* Sends the zones whose duty cycle changed enough as one batch. Called
+ * every BMC_INTERVAL_MS, which bounds the BMC's round trips. A batch that
+ * does not fit the socket is dropped and made up for by the next one, a
+ * transport that went away is started again and gets every zone. */
+static void updateBmc(void) {
+  const unsigned int temp = chassisInput(CHASSIS_MAX_TEMP);
+  const unsigned int watts = chassisPower ? chassisInput(CHASSIS_SUM_POWER) : 0;
+  char batch[64 * (MAX_BMC_ZONES + 1)];
+  int len = 0;
+  unsigned int duty[MAX_BMC_ZONES], count = 0;
+  int sent[MAX_BMC_ZONES] = {0};
+  if (!bmc.manual)
+    len = snprintf(batch, sizeof(batch), BMC_MANUAL "\n");
+  for (unsigned int i = 0; i < bmc.zoneCount; i++) {
+    const BmcZone *zone = &bmc.zones[i];
+    duty[i] = followLine(zone->source == CHASSIS_SUM_POWER ? watts : temp,
+                         zone->from, zone->to, zone->minDuty, zone->maxDuty);
+    if (!worthWriting(bmc.duty[i], duty[i], zone->minDuty, BMC_DEADBAND))
+      continue;
+    len += snprintf(batch + len, sizeof(batch) - len, BMC_SET_ZONE "\n",
+                    zone->zone, duty[i]);
+    sent[i] = 1;
+    count++;
+  }
+  if (!count)
+    return;
+
+  if (bmc.fd < 0 && !startBmc()) {
+    bmc.errors++;
+    return;
+  }
+  const ssize_t n = send(bmc.fd, batch, len, MSG_NOSIGNAL);
+  if (n != len) {
+    DEBUG_PRINT("Failed to send %u commands to the BMC\n", count);
+    bmc.errors++;
+    if (n >= 0 || errno != EAGAIN)
+      stopBmc();
+    return;
+  }
+  bmc.manual = 1;
+  for (unsigned int i = 0; i < bmc.zoneCount; i++) {
+    if (sent[i])
+      bmc.duty[i] = duty[i];
+  }
+  bmc.batches++;
+  bmc.commands += count;
+}
+
+/* Saves every device's control state for the process we are about to exec.
+ * Text so that an upgraded binary can still read it. */
+static int writeHandoff(const char *path) {
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *f = fopen(tmpPath, "w");
+  if (!f) {
+    DEBUG_PRINT("Failed to open %s\n", tmpPath);
+    return 0;
+  }
+
+  fprintf(f, "fanController-handoff 2 %llu\n", monotonicMs());
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    const Device *device = &registry[d];
+    if (atomic_load(&device->state) == SLOT_FREE || device->retire)
+      continue;
+    fprintf(f, "device %s %u %u %u\n", device->uuid, device->prevTemperature,
+            device->fanCount, device->powerLimitOrig);
+    for (unsigned int i = 0; i < device->fanCount; i++) {
+      const Fan *fan = &device->fans[i];
+      fprintf(f, "fan %u %u %llu %llu %u %u %u %u %u %u\n", fan->prevFanSpeed,
+              fan->targetFanSpeed, fan->holdUntil, fan->changedAt,
+              fan->errorAvg16, fan->checks, fan->lagCount, fan->stallCount,
+              fan->degradedCount, fan->health);
+    }
+  }
+
+  if (fclose(f) != 0 || rename(tmpPath, path) != 0) {
+    DEBUG_PRINT("Failed to write %s\n", path);
+    unlink(tmpPath);
+    return 0;
+  }
+  return 1;
+}
+
+/* Loads state left by writeHandoff(), unless it is too old to trust. The
+ * file is removed so that a crash loop cannot resume from it again. */
+static void loadHandoff(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  unlink(path);
+
+  unsigned int version;
+  unsigned long long written;
+  if (fscanf(f, "fanController-handoff %u %llu", &version, &written) != 2 ||
+      version < 1 || version > 2 ||
+      monotonicMs() - written > HANDOFF_MAX_AGE_MS) {
+    DEBUG_PRINT("Ignoring stale or unknown handoff state\n");
+    fclose(f);
+    return;
+  }
+
+  while (handoffCount < MAX_DEVICES) {
+    HandoffState *h = &handoffStates[handoffCount];
+    if (fscanf(f, " device %95s %u %u", h->uuid, &h->prevTemperature,
+               &h->fanCount) != 3)
+      break;
+    h->powerLimit = 0; // version 1 did not cap power
+    if (version >= 2 && fscanf(f, " %u", &h->powerLimit) != 1)
+      break;
+    if (h->fanCount > MAX_FANS)
+      h->fanCount = MAX_FANS;
+    unsigned int i;
+    for (i = 0; i < h->fanCount; i++) {
+      if (fscanf(f, " fan %u %u %llu %llu %u %u %u %u %u %u",
+                 &h->fans[i].prevFanSpeed, &h->fans[i].targetFanSpeed,
+                 &h->fans[i].holdUntil, &h->fans[i].changedAt,
+                 &h->fans[i].errorAvg16, &h->fans[i].checks,
+                 &h->fans[i].lagCount, &h->fans[i].stallCount,
+                 &h->fans[i].degradedCount, &h->fans[i].health) != 10)
+        break;
+    }
+    if (i != h->fanCount)
+      break;
+    handoffCount++;
+  }
+  fclose(f);
+  DEBUG_PRINT("Loaded handoff state for %u devices\n", handoffCount);
+}
+
+/* Re-executes the binary at the path it was started from, see selfPath in
+ * main(), so an upgraded file on disk takes over. If that fails the fans
+ * and power limits go back to what the firmware had, as on any other exit.
+ */
+static void execHandoff(const char *path, char **argv) {
+  if (HISTORY_MODE)
+    flushHistory(HISTORY_DIR);
+  if (FLIGHT_MODE)
+    dumpFlights(FLIGHT_DIR);
+  if (MODEL_MODE)
+    saveModels(MODEL_PATH);
+  if (writeHandoff(HANDOFF_PATH)) {
+    nvml.Shutdown();
+    restoreChassisFans();
+    stopBmc();
+    execv(path, argv);
+    DEBUG_PRINT("Failed to exec %s, shutting down\n", path);
+    unlink(HANDOFF_PATH);
+    nvmlStart();
+  }
+  for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+    Device *device = &registry[d];
+    if (atomic_load(&device->state) == SLOT_FREE)
+      continue;
+    atomic_store(&device->state, SLOT_FREE);
+    if (nvml.DeviceGetHandleByUUID(device->uuid, &device->handle) !=
+        NVML_SUCCESS)
+      continue;
+    for (unsigned int i = 0; i < device->fanCount; i++)
+      nvml.DeviceSetDefaultFanSpeed(device->handle, i);
+    // The device threads left their power limits to the next process
+    if (device->powerLimitOrig &&
+        device->powerLimit != device->powerLimitOrig &&
+        nvml.DeviceSetPowerManagementLimit(device->handle,
+                                           device->powerLimitOrig) !=
+            NVML_SUCCESS)
+      DEBUG_PRINT("Failed to restore power limit for device %d\n",
+                  device->id);
+  }
+  handoff = 0;
+  cleanup(EXIT_FAILURE);
+}
+
+/* Creates a directory under /var/lib/fanController, and that one too. */
+static void makeStateDir(const char *dir) {
+  char parent[PATH_MAX];
+  snprintf(parent, sizeof(parent), "%s", dir);
+  *strrchr(parent, '/') = '\0';
+  mkdir(parent, 0755);
+  mkdir(dir, 0755);
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGHUP, signal_handler);
+  signal(SIGUSR2, signal_handler);
+
+  /* The binary's absolute path, for execHandoff(). argv[0] may have been
+   * found through PATH, and /proc/self/exe would exec the replaced file
+   * rather than an upgrade installed over it. */
+  char selfPath[PATH_MAX];
+  const ssize_t selfLength = readlink("/proc/self/exe", selfPath,
+                                      sizeof(selfPath) - 1);
+  if (selfLength > 0)
+    selfPath[selfLength] = '\0';
+  else
+    snprintf(selfPath, sizeof(selfPath), "%s", argv[0]);
+
+  nvmlStart();
+  /* Everything the control path touches now exists or is static. With
+   * MCL_FUTURE the stacks of device threads are faulted in when created.
+   * One malloc arena keeps per thread arenas from being locked as well. */
+  if (LOCK_MEMORY) {
+    mallopt(M_ARENA_MAX, 1);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+      DEBUG_PRINT("Failed to lock memory, continuing unlocked\n");
+  }
+  setTimerSlack();
+  if (PLACEMENT) {
+    cpu_set_t housekeeping;
+    parseCpuList(HOUSEKEEPING_CPUS, &housekeeping);
+    pinThread(&housekeeping);
+  }
+  if (AMBIENT_MODE) {
+    findAmbientSensors(HWMON_ROOT);
+    readAmbient();
+  }
+  if (CHASSIS_MODE)
+    findChassisFans(HWMON_ROOT, ChassisFans);
+  if (BMC_MODE)
+    initBmc(BmcTransport, BmcZones);
+  if (MODEL_MODE)
+    loadModels(MODEL_PATH);
+  loadHandoff(HANDOFF_PATH);
+  if (rescanDevices() < 1) {
+    DEBUG_PRINT("Unsupported: No Nvidia Devices found.\n");
+    cleanup(EXIT_FAILURE);
+  }
+  handoffCount = 0; // only devices present at startup resume
+
+  // Normally created by systemd through RuntimeDirectory=
+  char statusDir[] = STATUS_PATH;
+  *strrchr(statusDir, '/') = '\0';
+  mkdir(statusDir, 0755);
+  // Normally created by systemd through StateDirectory=
+  if (HISTORY_MODE)
+    makeStateDir(HISTORY_DIR);
+  if (FLIGHT_MODE)
+    makeStateDir(FLIGHT_DIR);
+  if (MODEL_MODE) {
+    char modelDir[] = MODEL_PATH;
+    *strrchr(modelDir, '/') = '\0';
+    mkdir(modelDir, 0755);
+  }
+
+  const int hintFd = HINT_MODE ? openHintSocket() : -1;
+  unsigned long long nextStatus = monotonicMs();
+  unsigned long long nextRescan = nextStatus + RESCAN_INTERVAL_MS;
+  unsigned long long nextAmbient = nextStatus + AMBIENT_INTERVAL_MS;
+  unsigned long long nextChassis = nextStatus + CHASSIS_INTERVAL_MS;
+  unsigned long long nextBmc = nextStatus + BMC_INTERVAL_MS;
+  unsigned long long nextHistory = nextStatus + HISTORY_FLUSH_MS;
+  unsigned long long nextModels = nextStatus + MODEL_SAVE_MS;
+  while (!terminate) {
+    const unsigned long long now = monotonicMs();
+    if (rescanRequested || (RESCAN_INTERVAL_MS && now >= nextRescan)) {
+      rescanRequested = 0;
+      rescanDevices();
+      nextRescan = now + RESCAN_INTERVAL_MS;
+    }
+    if (now >= nextStatus) {
+      writeStatus();
+      nextStatus += STATUS_INTERVAL_MS;
+    }
+    if (ambientCount && now >= nextAmbient) {
+      readAmbient();
+      nextAmbient = now + AMBIENT_INTERVAL_MS;
+    }
+    if (chassisCount && now >= nextChassis) {
+      updateChassisFans();
+      nextChassis = now + CHASSIS_INTERVAL_MS;
+    }
+    if (bmc.zoneCount && now >= nextBmc) {
+      updateBmc();
+      nextBmc = now + BMC_INTERVAL_MS;
+    }
+    if (FLIGHT_MODE)
+      dumpFlights(FLIGHT_DIR);
+    if (HISTORY_MODE && now >= nextHistory) {
+      flushHistory(HISTORY_DIR);
+      nextHistory = now + HISTORY_FLUSH_MS;
+    }
+    if (MODEL_MODE && now >= nextModels) {
+      saveModels(MODEL_PATH);
+      nextModels = now + MODEL_SAVE_MS;
+    }
+    unsigned long long deadline =
+        RESCAN_INTERVAL_MS && nextRescan < nextStatus ? nextRescan
+                                                      : nextStatus;
+    if (ambientCount && nextAmbient < deadline)
+      deadline = nextAmbient;
+    if (chassisCount && nextChassis < deadline)
+      deadline = nextChassis;
+    if (bmc.zoneCount && nextBmc < deadline)
+      deadline = nextBmc;
+    if (HISTORY_MODE && nextHistory < deadline)
+      deadline = nextHistory;
+    if (MODEL_MODE && nextModels < deadline)
+      deadline = nextModels;
+    if (hintFd >= 0)
+      waitForHints(hintFd, deadline);
+    else
+      sleepUntilMs(deadline);
+  }
+
+  if (handoff) {
+    for (unsigned int d = 0; d < MAX_DEVICES; d++) {
+      if (atomic_load(&registry[d].state) != SLOT_FREE) {
+        pthread_join(registry[d].thread, NULL);
+        atomic_store(&registry[d].state, SLOT_EXITED);
+      }
+    }
+    execHandoff(selfPath, argv);
   }
 
-  cleanup(EXIT_SUCCESS);
+  cleanup(exitCode);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,22 @@
+# Fan curves for fanController, compiled into fanCurve.h by genCurve.awk.
+#
+# A curve starts with "curve default" or "curve <fan index>" and lists one
+# breakpoint per line:
+#
+#   temperature(C)  fan(%)  rise(C)  fall(C)
+#
+# rise and fall are the hysteresis for the segment starting at that
+# breakpoint: how far the temperature must pass a point on the curve before
+# the fans follow it up or down. Temperatures must be strictly increasing,
+# fan speeds must not decrease, and a fan speed of 0 asks for zero RPM.
+# The default curve sets MIN_TEMP and MAX_TEMP, other curves must stay
+# within it.
+
+curve default
+55   40   1   3
+80  100   0   0
+
+# Fan 1 of every device follows its own curve, e.g. a quieter one:
+# curve 1
+# 55   35   1   3
+# 80  100   0   0
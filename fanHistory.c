@@ -0,0 +1,221 @@
+/* Reads the history fanController keeps with HISTORY_MODE, see history.h.
+ *
+ *   ./fanHistory [-d dir] [-g gpu] [-f from] [-t to] [-c]
+ *
+ * Prints a summary per GPU of the samples between from and to, or with -c
+ * every sample as CSV. Times are UTC, as YYYY-MM-DD[THH:MM[:SS]] or seconds
+ * since the epoch. -g matches the start of a GPU's UUID. Only the daily
+ * files in range are mapped, so a query over a year of history reads a
+ * single pass of compact blocks. */
+
+#define _GNU_SOURCE
+#include "history.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_GPUS 64
+
+typedef struct {
+  char uuid[HISTORY_UUID_SIZE];
+  unsigned long long samples;
+  int64_t first, last;
+  unsigned int tempMin, tempMax, fanMax;
+  unsigned long long tempSum, fanSum;
+} Summary;
+
+static Summary gpus[MAX_GPUS];
+static unsigned int gpuCount = 0;
+
+/* Milliseconds since the epoch of a time argument, or -1 if malformed. */
+static int64_t parseTime(const char *arg) {
+  static const char *const Formats[] = {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M",
+                                        "%Y-%m-%d", NULL};
+  char *end;
+  const long long seconds = strtoll(arg, &end, 10);
+  if (*arg && !*end)
+    return seconds * 1000;
+  for (unsigned int i = 0; Formats[i]; i++) {
+    struct tm tm = {0};
+    end = strptime(arg, Formats[i], &tm);
+    if (end && !*end)
+      return (int64_t)timegm(&tm) * 1000;
+  }
+  return -1;
+}
+
+static void formatTime(char *buf, const size_t size, const int64_t ms) {
+  const time_t t = ms / 1000;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static Summary *findGpu(const char *uuid) {
+  for (unsigned int i = 0; i < gpuCount; i++) {
+    if (strcmp(gpus[i].uuid, uuid) == 0)
+      return &gpus[i];
+  }
+  if (gpuCount == MAX_GPUS)
+    return NULL;
+  Summary *gpu = &gpus[gpuCount++];
+  snprintf(gpu->uuid, sizeof(gpu->uuid), "%s", uuid);
+  gpu->tempMin = UINT_MAX;
+  return gpu;
+}
+
+static int compareNames(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Walks the blocks of one daily file. Returns 0 if it could not be read. */
+static int readFile(const char *path, const char *gpu, const int64_t from,
+                    const int64_t to, const int csv) {
+  static HistorySample samples[HISTORY_MAX_SAMPLES];
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return 0;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  const unsigned char *data =
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+  madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+  const unsigned char *p = data, *end = data + st.st_size, *encoded;
+  HistoryBlock block;
+  while ((encoded = historyNext(p, end, &block))) {
+    p = encoded + block.size;
+    block.uuid[HISTORY_UUID_SIZE - 1] = '\0';
+    if (block.start > to || strncmp(block.uuid, gpu, strlen(gpu)) != 0)
+      continue;
+    const int count = historyDecode(&block, encoded, samples);
+    Summary *summary = findGpu(block.uuid);
+    if (count < 0 || !summary)
+      continue;
+    for (int i = 0; i < count; i++) {
+      const HistorySample *s = &samples[i];
+      if (s->ms < from || s->ms > to)
+        continue;
+      if (csv) {
+        char time[32];
+        formatTime(time, sizeof(time), s->ms);
+        printf("%s,%s,%u,%u\n", time, block.uuid, s->temperature, s->fan);
+      }
+      if (!summary->samples++)
+        summary->first = s->ms;
+      summary->last = s->ms;
+      summary->tempSum += s->temperature;
+      summary->fanSum += s->fan;
+      if (s->temperature < summary->tempMin)
+        summary->tempMin = s->temperature;
+      if (s->temperature > summary->tempMax)
+        summary->tempMax = s->temperature;
+      if (s->fan > summary->fanMax)
+        summary->fanMax = s->fan;
+    }
+  }
+  munmap((void *)data, st.st_size);
+  return 1;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: fanHistory [-d dir] [-g gpu] [-f from] [-t to] "
+                  "[-c]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *dir = HISTORY_DIR, *gpu = "";
+  int64_t from = 0, to = INT64_MAX;
+  int csv = 0, opt;
+  while ((opt = getopt(argc, argv, "d:g:f:t:c")) != -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'g':
+      gpu = optarg;
+      break;
+    case 'f':
+      if ((from = parseTime(optarg)) < 0)
+        usage();
+      break;
+    case 't':
+      if ((to = parseTime(optarg)) < 0)
+        usage();
+      break;
+    case 'c':
+      csv = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  DIR *d = opendir(dir);
+  if (!d) {
+    perror(dir);
+    return EXIT_FAILURE;
+  }
+  // A block is filed under the day it starts, so it can reach into the next
+  const long long firstDay = from / HISTORY_DAY_MS - 1;
+  const long long lastDay = to / HISTORY_DAY_MS;
+  char **names = NULL;
+  size_t nameCount = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    const long long day = historyFileDay(entry->d_name);
+    if (day < 0 || day < firstDay || day > lastDay)
+      continue;
+    char **grown = realloc(names, (nameCount + 1) * sizeof(*names));
+    if (!grown)
+      break;
+    names = grown;
+    names[nameCount++] = strdup(entry->d_name);
+  }
+  closedir(d);
+  qsort(names, nameCount, sizeof(*names), compareNames);
+
+  if (csv)
+    printf("time,gpu,temperature,fan\n");
+  for (size_t i = 0; i < nameCount; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    if (!readFile(path, gpu, from, to, csv))
+      perror(path);
+    free(names[i]);
+  }
+  free(names);
+  if (csv)
+    return EXIT_SUCCESS;
+
+  for (unsigned int i = 0; i < gpuCount; i++) {
+    const Summary *s = &gpus[i];
+    if (!s->samples)
+      continue;
+    char first[32], last[32];
+    formatTime(first, sizeof(first), s->first);
+    formatTime(last, sizeof(last), s->last);
+    printf("%s\n"
+           "  samples      %llu, %s to %s\n"
+           "  temperature  min %u C, avg %.1f C, max %u C\n"
+           "  fan          avg %.1f %%, max %u %%\n",
+           s->uuid, s->samples, first, last, s->tempMin,
+           (double)s->tempSum / s->samples, s->tempMax,
+           (double)s->fanSum / s->samples, s->fanMax);
+  }
+  return EXIT_SUCCESS;
+}
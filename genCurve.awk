@@ -0,0 +1,132 @@
+# Generates fanCurve.h from fanCurve.spec, see the spec for its format.
+# The curves are expanded here into the heating and cooling tables the
+# controller looks up, using the same integer interpolation it always has.
+
+function fail(msg) {
+  printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+  failed = 1
+  exit 1
+}
+
+function speed(c, t,   i, n, rise100, slope) {
+  n = count[c]
+  if (n == 1 || t <= temp[c, 0])
+    return fan[c, 0]
+  if (t >= temp[c, n - 1])
+    return fan[c, n - 1]
+  for (i = 0; t > temp[c, i]; i++)
+    continue
+  rise100 = (fan[c, i] - fan[c, i - 1]) * 100
+  slope = int(rise100 / (temp[c, i] - temp[c, i - 1]))
+  return fan[c, i - 1] + int((t - temp[c, i - 1]) * slope / 100)
+}
+
+function row(values, n,   i, out) {
+  out = values[0]
+  for (i = 1; i < n; i++)
+    out = out ", " values[i]
+  return out
+}
+
+/^[ \t]*(#|$)/ { next }
+
+$1 == "curve" {
+  if (NF != 2 || ($2 != "default" && $2 !~ /^[0-9]+$/))
+    fail("expected \"curve default\" or \"curve <fan index>\"")
+  if ($2 in curveOf)
+    fail("curve " $2 " defined twice")
+  if (curves == 0 && $2 != "default")
+    fail("the default curve must come first")
+  c = curves++
+  name[c] = $2
+  curveOf[$2] = c
+  count[c] = 0
+  next
+}
+
+{
+  if (curves == 0)
+    fail("breakpoint outside of a curve")
+  if (NF != 4 || $0 !~ /^[ \t0-9]+$/)
+    fail("expected: temperature fan rise fall")
+  n = count[c]++
+  temp[c, n] = $1 + 0
+  fan[c, n] = $2 + 0
+  rise[c, n] = $3 + 0
+  fall[c, n] = $4 + 0
+  line[c, n] = FNR
+}
+
+END {
+  if (failed)
+    exit 1
+  if (curves == 0 || count[0] == 0)
+    fail("no default curve")
+  minTemp = temp[0, 0]
+  maxTemp = temp[0, count[0] - 1]
+
+  print "/* Generated from fanCurve.spec by genCurve.awk, do not edit. */"
+  print ""
+  print "#define MIN_TEMP " minTemp " // First temperature of the default curve"
+  print "#define MAX_TEMP " maxTemp " // Last temperature of the default curve"
+  print ""
+  print "// Compile time sanity checks. These are here to protect you"
+  for (c = 0; c < curves; c++) {
+    n = count[c]
+    last = temp[c, n - 1]
+    where = "curve " name[c]
+    printf("_Static_assert(%d >= MIN_TEMP && %d <= MAX_TEMP,\n",
+           temp[c, 0], last)
+    printf("               \"%s must stay within MIN_TEMP and MAX_TEMP\");\n",
+           where)
+    printf("_Static_assert(%d <= 90, \"%s must not exceed 90C\");\n",
+           last, where)
+    printf("_Static_assert(%d <= 100, \"%s must not exceed 100%%\");\n",
+           fan[c, n - 1], where)
+    for (i = 0; i + 1 < n; i++) {
+      where = FILENAME ":" line[c, i + 1]
+      printf("_Static_assert(%d < %d, \"%s: temperatures must increase\");\n",
+             temp[c, i], temp[c, i + 1], where)
+      printf("_Static_assert(%d <= %d, \"%s: fan speeds must not drop\");\n",
+             fan[c, i], fan[c, i + 1], where)
+    }
+  }
+  print ""
+
+  print "// Fan index of each curve after the default one, -1 terminated"
+  fans = ""
+  for (c = 1; c < curves; c++)
+    fans = fans name[c] ", "
+  print "#define FAN_CURVE_FANS {" fans "-1}"
+  print ""
+
+  # The default curve itself, for measuring what the thresholds add
+  print "// Default curve without its thresholds, MIN_TEMP to MAX_TEMP"
+  for (t = minTemp; t <= maxTemp; t++)
+    raw[t - minTemp] = speed(0, t)
+  print "#define FAN_CURVE_RAW {" row(raw, maxTemp - minTemp + 1) "}"
+  print ""
+
+  # The rising table lags the curve by the segment's rise threshold and the
+  # falling table leads it by the fall threshold. The ends of the curve are
+  # always reachable.
+  print "// {heating, cooling} table per curve, default first"
+  print "#define FAN_CURVE_TABLES \\"
+  print "  { \\"
+  for (c = 0; c < curves; c++) {
+    n = count[c]
+    segment = 0
+    for (t = minTemp; t <= maxTemp; t++) {
+      while (segment + 1 < n - 1 && t >= temp[c, segment + 1])
+        segment++
+      r = rise[c, segment]
+      up[t - minTemp] = speed(c, t > r ? t - r : 0)
+      down[t - minTemp] = speed(c, t + fall[c, segment])
+    }
+    up[maxTemp - minTemp] = fan[c, n - 1]
+    down[0] = fan[c, 0]
+    print "    {{" row(up, maxTemp - minTemp + 1) "}, \\"
+    print "     {" row(down, maxTemp - minTemp + 1) "}}, \\"
+  }
+  print "  }"
+}
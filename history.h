@@ -0,0 +1,199 @@
+/* On-disk history of GPU temperatures and fan speeds, written by
+ * fanController with HISTORY_MODE and read by fanHistory.
+ *
+ * HISTORY_DIR holds one file per UTC day, named after HISTORY_FILE. A file
+ * is a plain sequence of blocks, each the samples of one GPU since the last
+ * flush:
+ *
+ *   HistoryBlock   header with the first sample and the encoded size
+ *   samples        one per sample after the first, see below
+ *
+ * Every further sample starts with a control byte:
+ *
+ *   bit 6      set if the timestamp's delta of delta follows as a varint
+ *   bits 5-3   temperature delta, zigzag 0-6, 7 if a varint of the rest
+ *   bits 2-0   fan delta, the same
+ *
+ * followed by those varints in that order. A GPU sampled at a steady rate
+ * and temperature takes a single byte per sample. Files are only ever
+ * appended to and can be read through mmap. A block cut short by a crash is
+ * dropped when the file is next opened for writing. Numbers are in host
+ * byte order. */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define HISTORY_DIR "/var/lib/fanController/history"
+#define HISTORY_FILE "history-%04d-%02d-%02d.fch" // year, month, day
+#define HISTORY_MAGIC 0x31484346                   // "FCH1"
+#define HISTORY_MAX_SAMPLES 512                    // per block
+#define HISTORY_UUID_SIZE 48
+#define HISTORY_DAY_MS 86400000LL
+
+typedef struct {
+  int64_t ms;          // since the epoch
+  uint8_t temperature; // C
+  uint8_t fan;         // highest commanded fan %
+} HistorySample;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t count; // samples in the block
+  uint16_t size;  // encoded bytes after the header
+  int64_t start;  // first sample, ms since the epoch
+  uint8_t temperature;
+  uint8_t fan;
+  uint8_t reserved[6];
+  char uuid[HISTORY_UUID_SIZE];
+} HistoryBlock;
+
+_Static_assert(sizeof(HistoryBlock) == 72, "HistoryBlock is on disk");
+
+/* Longest block: a control byte and three 10 byte varints per sample */
+#define HISTORY_BLOCK_MAX                                                      \
+  (sizeof(HistoryBlock) + (HISTORY_MAX_SAMPLES - 1) * 31)
+_Static_assert(HISTORY_BLOCK_MAX - sizeof(HistoryBlock) <= UINT16_MAX,
+               "HistoryBlock.size is 16 bits");
+
+static inline uint64_t historyZigzag(const int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t historyUnzigzag(const uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline unsigned char *historyPutVarint(unsigned char *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (unsigned char)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (unsigned char)v;
+  return p;
+}
+
+/* Returns the byte after the varint, or NULL if it runs past end. */
+static inline const unsigned char *historyGetVarint(const unsigned char *p,
+                                                    const unsigned char *end,
+                                                    uint64_t *v) {
+  *v = 0;
+  for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+    const unsigned char byte = *p++;
+    *v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return p;
+  }
+  return NULL;
+}
+
+/* Encodes count samples of one GPU as a block, header included, into out,
+ * which must hold HISTORY_BLOCK_MAX bytes. Returns the bytes used. */
+static inline size_t historyEncode(const char *uuid,
+                                   const HistorySample *samples,
+                                   const unsigned int count,
+                                   unsigned char *out) {
+  HistoryBlock block = {.magic = HISTORY_MAGIC,
+                        .count = count,
+                        .start = samples[0].ms,
+                        .temperature = samples[0].temperature,
+                        .fan = samples[0].fan};
+  snprintf(block.uuid, sizeof(block.uuid), "%s", uuid);
+
+  unsigned char *p = out + sizeof(block);
+  int64_t prevDelta = 0;
+  for (unsigned int i = 1; i < count; i++) {
+    const HistorySample *prev = &samples[i - 1], *s = &samples[i];
+    const int64_t delta = s->ms - prev->ms;
+    const uint64_t dod = historyZigzag(delta - prevDelta);
+    const uint64_t temp = historyZigzag(s->temperature - prev->temperature);
+    const uint64_t fan = historyZigzag(s->fan - prev->fan);
+    *p++ = (dod != 0) << 6 | (temp < 7 ? temp : 7) << 3 | (fan < 7 ? fan : 7);
+    if (dod)
+      p = historyPutVarint(p, dod);
+    if (temp >= 7)
+      p = historyPutVarint(p, temp - 7);
+    if (fan >= 7)
+      p = historyPutVarint(p, fan - 7);
+    prevDelta = delta;
+  }
+  block.size = p - out - sizeof(block);
+  memcpy(out, &block, sizeof(block));
+  return p - out;
+}
+
+/* Decodes the samples of a block into out, which must hold
+ * HISTORY_MAX_SAMPLES. Returns the count, or -1 if the block is malformed. */
+static inline int historyDecode(const HistoryBlock *block,
+                                const unsigned char *data,
+                                HistorySample *out) {
+  if (block->count == 0 || block->count > HISTORY_MAX_SAMPLES)
+    return -1;
+  const unsigned char *p = data, *end = data + block->size;
+  out[0].ms = block->start;
+  out[0].temperature = block->temperature;
+  out[0].fan = block->fan;
+  int64_t delta = 0;
+  for (unsigned int i = 1; i < block->count; i++) {
+    if (p >= end)
+      return -1;
+    const unsigned int control = *p++;
+    uint64_t dod = 0, temp = control >> 3 & 7, fan = control & 7, rest;
+    if (control & 0x40 && !(p = historyGetVarint(p, end, &dod)))
+      return -1;
+    if (temp == 7 && (p = historyGetVarint(p, end, &rest)))
+      temp += rest;
+    if (p && fan == 7 && (p = historyGetVarint(p, end, &rest)))
+      fan += rest;
+    if (!p)
+      return -1;
+    delta += historyUnzigzag(dod);
+    out[i].ms = out[i - 1].ms + delta;
+    out[i].temperature = out[i - 1].temperature + historyUnzigzag(temp);
+    out[i].fan = out[i - 1].fan + historyUnzigzag(fan);
+  }
+  return p == end ? block->count : -1;
+}
+
+/* Reads the block header at p of a file ending at end. Returns its encoded
+ * samples, or NULL at the end of the file or at a block cut short. */
+static inline const unsigned char *historyNext(const unsigned char *p,
+                                               const unsigned char *end,
+                                               HistoryBlock *block) {
+  if (end - p < (ptrdiff_t)sizeof(*block))
+    return NULL;
+  memcpy(block, p, sizeof(*block));
+  p += sizeof(*block);
+  if (block->magic != HISTORY_MAGIC || end - p < block->size)
+    return NULL;
+  return p;
+}
+
+/* Days since the epoch of a history file name, or -1 for other files. */
+static inline long long historyFileDay(const char *name) {
+  struct tm tm = {0};
+  int length = 0;
+  if (sscanf(name, HISTORY_FILE "%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &length) != 3 ||
+      length == 0 || name[length] != '\0')
+    return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm) / 86400;
+}
+
+static inline void historyFileName(char *name, const size_t size,
+                                   const long long day) {
+  const time_t t = day * 86400;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  snprintf(name, size, HISTORY_FILE, tm.tm_year + 1900, tm.tm_mon + 1,
+           tm.tm_mday);
+}
+
+#endif
@@ -0,0 +1,184 @@
+/* A stand-in for libnvidia-ml, loaded by `make bench` through the same
+ * dlopen path as the real driver. It reports NVML_STUB_GPUS GPUs at a fixed
+ * temperature whose fans read back what was last set.
+ *
+ *   nvmlStub.so        current entry points, a few optional ones included
+ *   nvmlStubOld.so     -DNVML_STUB_OLD, the unversioned names of older
+ *                      drivers and none of the optional entry points
+ *   nvmlStubBroken.so  -DNVML_STUB_BROKEN, lacks manual fan control
+ *
+ * The first fan write is timestamped in nvmlStubFirstWriteNs, on
+ * CLOCK_MONOTONIC, for the bench to time a start against. */
+
+#define NVML_NO_UNVERSIONED_FUNC_DEFS
+#include "nvml.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define NVML_STUB_GPUS 2
+#define NVML_STUB_FANS 2
+#define NVML_STUB_TEMP 60
+
+_Atomic unsigned long long nvmlStubFirstWriteNs = 0;
+_Atomic unsigned int nvmlStubWrites = 0;
+static _Atomic unsigned int fanSpeeds[NVML_STUB_GPUS][NVML_STUB_FANS];
+
+static unsigned int gpuIndex(const nvmlDevice_t device) {
+  return (unsigned int)((uintptr_t)device - 1) % NVML_STUB_GPUS;
+}
+
+static nvmlReturn_t init(void) { return NVML_SUCCESS; }
+
+static nvmlReturn_t getCount(unsigned int *count) {
+  *count = NVML_STUB_GPUS;
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t getHandleByIndex(unsigned int index,
+                                     nvmlDevice_t *device) {
+  if (index >= NVML_STUB_GPUS)
+    return NVML_ERROR_INVALID_ARGUMENT;
+  *device = (nvmlDevice_t)(uintptr_t)(index + 1);
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t getPciInfo(nvmlDevice_t device, nvmlPciInfo_t *pci) {
+  memset(pci, 0, sizeof(*pci));
+  snprintf(pci->busId, sizeof(pci->busId), "00000000:%02x:00.0",
+           0x41 + gpuIndex(device));
+  return NVML_SUCCESS;
+}
+
+#ifdef NVML_STUB_OLD
+nvmlReturn_t nvmlInit(void) { return init(); }
+
+nvmlReturn_t nvmlDeviceGetCount(unsigned int *count) {
+  return getCount(count);
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByIndex(unsigned int index,
+                                        nvmlDevice_t *device) {
+  return getHandleByIndex(index, device);
+}
+
+nvmlReturn_t nvmlDeviceGetPciInfo_v2(nvmlDevice_t device, nvmlPciInfo_t *pci) {
+  return getPciInfo(device, pci);
+}
+
+nvmlReturn_t
+nvmlDeviceGetCurrentClocksThrottleReasons(nvmlDevice_t device,
+                                          unsigned long long *reasons) {
+  (void)device;
+  *reasons = 0;
+  return NVML_SUCCESS;
+}
+#else
+nvmlReturn_t nvmlInit_v2(void) { return init(); }
+
+nvmlReturn_t nvmlDeviceGetCount_v2(unsigned int *count) {
+  return getCount(count);
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByIndex_v2(unsigned int index,
+                                           nvmlDevice_t *device) {
+  return getHandleByIndex(index, device);
+}
+
+nvmlReturn_t nvmlDeviceGetPciInfo_v3(nvmlDevice_t device, nvmlPciInfo_t *pci) {
+  return getPciInfo(device, pci);
+}
+
+nvmlReturn_t
+nvmlDeviceGetCurrentClocksEventReasons(nvmlDevice_t device,
+                                       unsigned long long *reasons) {
+  (void)device;
+  *reasons = 0;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPowerUsage(nvmlDevice_t device,
+                                     unsigned int *power) {
+  (void)device;
+  *power = 200000;
+  return NVML_SUCCESS;
+}
+#endif
+
+nvmlReturn_t nvmlShutdown(void) { return NVML_SUCCESS; }
+
+const char *nvmlErrorString(nvmlReturn_t result) {
+  (void)result;
+  return "stub";
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByUUID(const char *uuid,
+                                       nvmlDevice_t *device) {
+  unsigned int index;
+  if (sscanf(uuid, "GPU-stub-%u", &index) != 1)
+    return NVML_ERROR_NOT_FOUND;
+  return getHandleByIndex(index, device);
+}
+
+nvmlReturn_t nvmlDeviceGetUUID(nvmlDevice_t device, char *uuid,
+                               unsigned int length) {
+  snprintf(uuid, length, "GPU-stub-%u", gpuIndex(device));
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetNumFans(nvmlDevice_t device, unsigned int *count) {
+  (void)device;
+  *count = NVML_STUB_FANS;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetMinMaxFanSpeed(nvmlDevice_t device,
+                                         unsigned int *min,
+                                         unsigned int *max) {
+  (void)device;
+  *min = 30;
+  *max = 100;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetTemperature(nvmlDevice_t device,
+                                      nvmlTemperatureSensors_t sensor,
+                                      unsigned int *temp) {
+  (void)device;
+  (void)sensor;
+  *temp = NVML_STUB_TEMP;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetFanSpeed_v2(nvmlDevice_t device, unsigned int fan,
+                                      unsigned int *speed) {
+  if (fan >= NVML_STUB_FANS)
+    return NVML_ERROR_INVALID_ARGUMENT;
+  *speed = fanSpeeds[gpuIndex(device)][fan];
+  return NVML_SUCCESS;
+}
+
+#ifndef NVML_STUB_BROKEN
+nvmlReturn_t nvmlDeviceSetFanSpeed_v2(nvmlDevice_t device, unsigned int fan,
+                                      unsigned int speed) {
+  if (fan >= NVML_STUB_FANS)
+    return NVML_ERROR_INVALID_ARGUMENT;
+  fanSpeeds[gpuIndex(device)][fan] = speed;
+  if (!atomic_fetch_add(&nvmlStubWrites, 1)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    atomic_store(&nvmlStubFirstWriteNs,
+                 (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+  }
+  return NVML_SUCCESS;
+}
+#endif
+
+nvmlReturn_t nvmlDeviceSetDefaultFanSpeed_v2(nvmlDevice_t device,
+                                             unsigned int fan) {
+  (void)device;
+  (void)fan;
+  return NVML_SUCCESS;
+}